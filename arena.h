@@ -0,0 +1,72 @@
+/*
+Scratch buffers kept from one picture to the next
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+While an arena is bound to a thread, the buffer of a slot is kept when it
+gets freed and handed out again for the next picture, so that processing
+many pictures of similar size does not allocate and fault in fresh memory
+every time. A slot holds a single buffer, so buffers living at the same
+time need their own slots. Other threads and unbound threads allocate as
+usual, which is why arena_free() only keeps the buffer of the slot.
+*/
+
+enum { ARENA_IMAGE, ARENA_TREE, ARENA_DESC, ARENA_FLAGS, ARENA_SLOTS };
+
+struct arena {
+	void *buf[ARENA_SLOTS];
+	size_t size[ARENA_SLOTS];
+};
+
+static __thread struct arena *arena_bound;
+
+static inline struct arena *arena_bind(struct arena *arena)
+{
+	struct arena *prev = arena_bound;
+	arena_bound = arena;
+	return prev;
+}
+
+static inline void *arena_malloc(int slot, size_t size)
+{
+	struct arena *arena = arena_bound;
+	if (!arena)
+		return malloc(size);
+	if (arena->size[slot] < size) {
+		free(arena->buf[slot]);
+		arena->buf[slot] = malloc(size);
+		arena->size[slot] = size;
+	}
+	return arena->buf[slot];
+}
+
+static inline void *arena_calloc(int slot, size_t num, size_t size)
+{
+	if (!arena_bound)
+		return calloc(num, size);
+	void *buf = arena_malloc(slot, num * size);
+	memset(buf, 0, num * size);
+	return buf;
+}
+
+static inline void arena_free(int slot, void *buf)
+{
+	if (!arena_bound || buf != arena_bound->buf[slot])
+		free(buf);
+}
+
+static inline void arena_release(struct arena *arena)
+{
+	for (int slot = 0; slot < ARENA_SLOTS; ++slot) {
+		free(arena->buf[slot]);
+		arena->buf[slot] = 0;
+		arena->size[slot] = 0;
+	}
+}
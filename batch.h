@@ -0,0 +1,80 @@
+/*
+Process a list of pairs of input and output files
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "lqt.h"
+#include "pool.h"
+
+/*
+The list file holds an input and an output file name for each picture,
+separated by white space. The pictures are processed concurrently on the
+worker pool, one picture on each thread, so reading and writing files
+overlaps with the computations for the other pictures. A job takes an
+idle context, so each thread reuses buffers from one picture to the next.
+*/
+
+struct batch {
+	int (*work)(struct lqt *, void *, char *, char *);
+	void *data;
+	char **names;
+	int *errors;
+	struct lqt **idle;
+	int num_idle;
+	pthread_mutex_t lock;
+};
+
+static inline void batch_worker(void *arg, int job)
+{
+	struct batch *batch = arg;
+	pthread_mutex_lock(&batch->lock);
+	struct lqt *lqt = batch->num_idle ? batch->idle[--batch->num_idle] : lqt_new();
+	pthread_mutex_unlock(&batch->lock);
+	batch->errors[job] = batch->work(lqt, batch->data, batch->names[2*job], batch->names[2*job+1]);
+	pthread_mutex_lock(&batch->lock);
+	batch->idle[batch->num_idle++] = lqt;
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static inline int batch_run(char *list, int (*work)(struct lqt *, void *, char *, char *), void *data)
+{
+	FILE *file = fopen(list, "r");
+	if (!file) {
+		fprintf(stderr, "could not open \"%s\" file to read.\n", list);
+		return 1;
+	}
+	int num = 0, max = 64;
+	char **names = malloc(sizeof(char *) * max);
+	while (fscanf(file, "%ms", names + num) == 1)
+		if (++num == max)
+			names = realloc(names, sizeof(char *) * (max *= 2));
+	fclose(file);
+	if (num % 2)
+		fprintf(stderr, "no output file for \"%s\" in \"%s\".\n", names[num-1], list);
+	struct batch batch = { work, data, names, calloc(num / 2 + 1, sizeof(int)),
+		malloc(sizeof(struct lqt *) * (num / 2 + 1)), 0, PTHREAD_MUTEX_INITIALIZER };
+	struct pool pool = { 0 };
+	struct pool *outer = pool_bind(&pool);
+	pool_run(batch_worker, &batch, num / 2);
+	pool_bind(outer);
+	pool_stop(&pool);
+	for (int i = 0; i < batch.num_idle; ++i)
+		lqt_delete(batch.idle[i]);
+	free(batch.idle);
+	int errors = num % 2;
+	for (int i = 0; i < num / 2; ++i)
+		errors += !!batch.errors[i];
+	for (int i = 0; i < num; ++i)
+		free(names[i]);
+	free(names);
+	free(batch.errors);
+	if (errors)
+		fprintf(stderr, "%d of %d pictures failed.\n", errors, (num + 1) / 2);
+	return !!errors;
+}
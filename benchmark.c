@@ -0,0 +1,202 @@
+/*
+Benchmark for the stages of the codec on synthetic pictures
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lqt.h"
+#include "context.h"
+#include "ppm.h"
+#include "vli.h"
+#include "bits.h"
+#include "timer.h"
+
+/*
+Each run of a picture goes through all stages, the first runs only warm
+up the caches and the buffers of the context. The fastest of the other
+runs counts for each stage, given in megabytes of RGB samples per second
+and in nanoseconds per pixel.
+*/
+
+#define WARMUP 2
+
+enum { PICTURE_FLAT, PICTURE_GRADIENT, PICTURE_NOISE, PICTURE_CARD, PICTURES };
+
+struct result {
+	const char *prefix;
+	const char *name;
+	long long best;
+};
+
+static void fill(uint8_t *pixels, int picture, int width, int height)
+{
+	static const uint8_t bars[7][3] = {
+		{ 191, 191, 191 }, { 191, 191, 0 }, { 0, 191, 191 }, { 0, 191, 0 },
+		{ 191, 0, 191 }, { 191, 0, 0 }, { 0, 0, 191 },
+	};
+	uint32_t seed = 2463534242;
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			uint8_t *pixel = pixels + 3 * ((size_t)width * y + x);
+			switch (picture) {
+			case PICTURE_FLAT:
+				pixel[0] = 110;
+				pixel[1] = 120;
+				pixel[2] = 130;
+				break;
+			case PICTURE_GRADIENT:
+				pixel[0] = 255 * x / width;
+				pixel[1] = 255 * y / height;
+				pixel[2] = 255 * (x + y) / (width + height);
+				break;
+			case PICTURE_NOISE:
+				for (int chan = 0; chan < 3; ++chan) {
+					seed ^= seed << 13;
+					seed ^= seed >> 17;
+					seed ^= seed << 5;
+					pixel[chan] = seed;
+				}
+				break;
+			case PICTURE_CARD: {
+				int bar = 7 * x / width;
+				if (3 * y >= 2 * height)
+					bar = 6 - bar;
+				memcpy(pixel, bars[bar], 3);
+				if (6 * y >= 5 * height)
+					memset(pixel, 16 + 223 * (6 * x / width % 2), 3);
+				break;
+			}
+			}
+		}
+	}
+}
+
+static void record(struct result *results, int *num, const char *prefix, const char *name, long long nanos)
+{
+	int i = 0;
+	while (i < *num && (strcmp(results[i].prefix, prefix) || strcmp(results[i].name, name)))
+		++i;
+	if (i == *num) {
+		results[i].prefix = prefix;
+		results[i].name = name;
+		results[i].best = nanos;
+		++*num;
+	} else if (results[i].best > nanos) {
+		results[i].best = nanos;
+	}
+}
+
+static int run(struct lqt *lqt, struct result *results, int *num, const uint8_t *pixels, int width, int height, int mode, char *name)
+{
+	long long start = timer_now();
+	if (!write_ppm(name, pixels, width, height))
+		return 1;
+	record(results, num, "", "write_ppm", timer_now() - start);
+	int w, h;
+	start = timer_now();
+	uint8_t *copy = read_ppm(name, &w, &h);
+	record(results, num, "", "read_ppm", timer_now() - start);
+	if (!copy)
+		return 1;
+	free(copy);
+
+	size_t samples = 3 * (size_t)width * height;
+	struct bits_writer *bits = bits_writer_memory(0, "memory");
+	struct vli_writer *vli = vli_writer(bits);
+	start = timer_now();
+	for (size_t i = 0; i < samples; ++i)
+		put_vli(vli, pixels[i]);
+	record(results, num, "", "put_vli", timer_now() - start);
+	delete_vli_writer(vli);
+	size_t size;
+	uint8_t *data = release_writer(bits, &size);
+	struct bits_reader *reader = bits_reader_memory(data, size, "memory");
+	struct vli_reader *vlr = vli_reader(reader);
+	int sum = 0;
+	start = timer_now();
+	for (size_t i = 0; i < samples; ++i)
+		sum += get_vli(vlr);
+	record(results, num, "", "get_vli", timer_now() - start);
+	delete_vli_reader(vlr);
+	close_reader(reader);
+	free(data);
+	if (sum < 0)
+		return 1;
+
+	const uint8_t *stream, *output;
+	start = timer_now();
+	if (lqt_encode(lqt, pixels, width, height, mode, 0, 0, &stream, &size))
+		return 1;
+	record(results, num, "", "encode", timer_now() - start);
+	for (int stage = 0; stage < STAGES; ++stage)
+		if (stage != STAGE_READ && (stage != STAGE_DESCEND || mode & 2))
+			record(results, num, "encode/", stage_name(stage), lqt->stats.nanos[stage]);
+	start = timer_now();
+	if (lqt_decode(lqt, stream, size, 0, -1, &output, &w, &h))
+		return 1;
+	record(results, num, "", "decode", timer_now() - start);
+	for (int stage = 0; stage < STAGES; ++stage)
+		if (stage != STAGE_DESCEND && stage != STAGE_READ)
+			record(results, num, "decode/", stage_name(stage), lqt->stats.nanos[stage]);
+	return memcmp(pixels, output, samples) != 0;
+}
+
+int main(int argc, char **argv)
+{
+	int mode = 1;
+	if (argc > 1)
+		mode = atoi(argv[1]);
+	int repeat = 5;
+	if (argc > 2)
+		repeat = atoi(argv[2]);
+	if (mode & ~31 || repeat < 1) {
+		fprintf(stderr, "usage: %s [MODE] [REPEAT] [SIZE]...\n", argv[0]);
+		return 1;
+	}
+	static const char *names[PICTURES] = { "flat", "gradient", "noise", "card" };
+	int defaults[] = { 256, 1024 };
+	int num_sizes = argc > 3 ? argc - 3 : 2;
+	char temp[] = "/tmp/benchmark-XXXXXX";
+	int fd = mkstemp(temp);
+	if (fd < 0) {
+		fprintf(stderr, "could not create temporary file.\n");
+		return 1;
+	}
+	close(fd);
+	struct lqt *lqt = lqt_new();
+	int error = 0;
+	printf("%-8s %5s %-16s %10s %10s\n", "picture", "size", "stage", "MB/s", "ns/pixel");
+	for (int s = 0; s < num_sizes && !error; ++s) {
+		int length = argc > 3 ? atoi(argv[3+s]) : defaults[s];
+		if (length < 1) {
+			fprintf(stderr, "size \"%s\" is not a positive number.\n", argv[3+s]);
+			error = 1;
+			break;
+		}
+		long long pixels = (long long)length * length;
+		uint8_t *picture = malloc(3 * pixels);
+		for (int p = 0; p < PICTURES && !error; ++p) {
+			fill(picture, p, length, length);
+			struct result results[32];
+			int num = 0;
+			for (int r = 0; r < WARMUP + repeat && !error; ++r) {
+				if (r == WARMUP)
+					num = 0;
+				error = run(lqt, results, &num, picture, length, length, mode, temp);
+			}
+			if (error)
+				fprintf(stderr, "%s picture of size %d failed.\n", names[p], length);
+			for (int i = 0; i < num && !error; ++i)
+				printf("%-8s %5d %-7s%-9s %10.1f %10.2f\n", names[p], length, results[i].prefix, results[i].name,
+					3000.0 * pixels / results[i].best, (double)results[i].best / pixels);
+		}
+		free(picture);
+	}
+	lqt_delete(lqt);
+	unlink(temp);
+	return error;
+}
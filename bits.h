@@ -7,113 +7,333 @@ Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
 #pragma once
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BITS_BUFFER (1 << 16)
 
 struct bits_reader {
 	FILE *file;
-	char *name;
-	int acc;
+	const char *name;
+	uint8_t *mem;
+	void *map;
+	const uint8_t *buf;
+	size_t pos;
+	size_t len;
+	size_t size;
+	size_t base;
+	size_t end;
+	uint64_t acc;
 	int cnt;
+	int prefix;
 };
 
 struct bits_writer {
 	FILE *file;
-	char *name;
-	int acc;
+	const char *name;
+	uint8_t *buf;
+	size_t pos;
+	size_t size;
+	uint64_t acc;
 	int cnt;
-	int cap;
-	int num;
+	long long cap;
+	size_t num;
 };
 
-struct bits_reader *bits_reader(char *name)
+static inline uint64_t bits_load(const uint8_t *buf)
+{
+	uint64_t val = 0;
+	for (int i = 0; i < 8; ++i)
+		val |= (uint64_t)buf[i] << (8 * i);
+	return val;
+}
+
+static inline void bits_store(uint8_t *buf, uint64_t val)
+{
+	for (int i = 0; i < 8; ++i)
+		buf[i] = val >> (8 * i);
+}
+
+static inline struct bits_reader *bits_reader_memory(const void *data, size_t size, const char *name)
+{
+	struct bits_reader *bits = malloc(sizeof(struct bits_reader));
+	bits->file = 0;
+	bits->name = name;
+	bits->mem = 0;
+	bits->map = 0;
+	bits->buf = data;
+	bits->pos = 0;
+	bits->len = size;
+	bits->size = size;
+	bits->base = 0;
+	bits->end = SIZE_MAX;
+	bits->acc = 0;
+	bits->cnt = 0;
+	bits->prefix = 0;
+	return bits;
+}
+
+static inline struct bits_reader *bits_reader(char *name)
 {
 	FILE *file = fopen(name, "r");
 	if (!file) {
 		fprintf(stderr, "could not open \"%s\" file to read.\n", name);
 		return 0;
 	}
-	struct bits_reader *bits = malloc(sizeof(struct bits_reader));
+	struct stat st;
+	int regular = !fstat(fileno(file), &st) && S_ISREG(st.st_mode);
+	if (regular && st.st_size > 0) {
+		void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (map != MAP_FAILED) {
+			fclose(file);
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			struct bits_reader *bits = bits_reader_memory(map, st.st_size, name);
+			bits->map = map;
+			return bits;
+		}
+	}
+	struct bits_reader *bits = bits_reader_memory(0, 0, name);
 	bits->file = file;
+	bits->buf = bits->mem = malloc(BITS_BUFFER);
+	if (regular)
+		bits->size = st.st_size;
+	return bits;
+}
+
+/*
+bits_writer_buffer() writes into the malloc()ed "buf" of "size" bytes,
+which grows as needed and is handed back by release_writer(). Readers
+and writers in memory take the "name" of their stream for the messages
+of errors.
+*/
+
+static inline struct bits_writer *bits_writer_buffer(uint8_t *buf, size_t size, long long capacity, const char *name)
+{
+	struct bits_writer *bits = malloc(sizeof(struct bits_writer));
+	if (size < BITS_BUFFER) {
+		size = BITS_BUFFER;
+		buf = realloc(buf, size);
+	}
+	bits->file = 0;
 	bits->name = name;
+	bits->size = size;
+	bits->buf = buf;
+	bits->pos = 0;
 	bits->acc = 0;
 	bits->cnt = 0;
+	bits->cap = capacity;
+	bits->num = 0;
 	return bits;
 }
 
-struct bits_writer *bits_writer(char *name, int capacity)
+static inline struct bits_writer *bits_writer_memory(long long capacity, const char *name)
+{
+	return bits_writer_buffer(0, 0, capacity, name);
+}
+
+static inline struct bits_writer *bits_writer(char *name, long long capacity)
 {
 	FILE *file = fopen(name, "w");
 	if (!file) {
 		fprintf(stderr, "could not open \"%s\" file to write.\n", name);
 		return 0;
 	}
-	struct bits_writer *bits = malloc(sizeof(struct bits_writer));
+	struct bits_writer *bits = bits_writer_memory(capacity, name);
 	bits->file = file;
-	bits->name = name;
-	bits->acc = 0;
-	bits->cnt = 0;
-	bits->cap = capacity;
-	bits->num = 0;
 	return bits;
 }
 
-int bits_count(struct bits_writer *bits)
+static inline long long bits_count(struct bits_writer *bits)
+{
+	return bits->num * 8LL + bits->cnt;
+}
+
+static inline int bits_flush(struct bits_writer *bits)
+{
+	if (!bits->file) {
+		if (bits->pos + 8 > bits->size) {
+			bits->size *= 2;
+			bits->buf = realloc(bits->buf, bits->size);
+		}
+		return 0;
+	}
+	size_t len = bits->pos;
+	bits->pos = 0;
+	if (len != fwrite(bits->buf, 1, len, bits->file)) {
+		fprintf(stderr, "could not write to file \"%s\".\n", bits->name);
+		return -1;
+	}
+	return 0;
+}
+
+static inline int bits_emit(struct bits_writer *bits, uint64_t word)
+{
+	if (bits->pos + 8 > bits->size) {
+		int ret = bits_flush(bits);
+		if (ret)
+			return ret;
+	}
+	bits_store(bits->buf + bits->pos, word);
+	bits->pos += 8;
+	bits->num += 8;
+	return 0;
+}
+
+static inline void bits_fill(struct bits_reader *bits)
+{
+	if (!bits->file)
+		return;
+	size_t rem = bits->len - bits->pos;
+	memmove(bits->mem, bits->buf + bits->pos, rem);
+	bits->base += bits->pos;
+	bits->pos = 0;
+	size_t num = BITS_BUFFER - rem;
+	if (num > bits->end - bits->base - rem)
+		num = bits->end - bits->base - rem;
+	bits->len = rem + fread(bits->mem + rem, 1, num, bits->file);
+}
+
+static inline void bits_refill(struct bits_reader *bits)
+{
+	if (bits->len - bits->pos < 8)
+		bits_fill(bits);
+	if (bits->len - bits->pos >= 8) {
+		bits->acc |= bits_load(bits->buf + bits->pos) << bits->cnt;
+		int num = (63 - bits->cnt) / 8;
+		bits->pos += num;
+		bits->cnt += 8 * num;
+	} else {
+		while (bits->cnt <= 56 && bits->pos < bits->len) {
+			bits->acc |= (uint64_t)bits->buf[bits->pos++] << bits->cnt;
+			bits->cnt += 8;
+		}
+	}
+}
+
+/*
+limit_reader() ends the stream after its first "size" bytes, as if the
+stream was truncated there. bits_offset() gives the number of bytes read
+so far, rounded down to whole bytes. Setting "prefix" tells the reader
+that its stream may end anywhere, like the layers of an embedded stream
+cut to a budget, so that running out of it is not reported by
+bits_ended(), unless the file had an error.
+*/
+
+static inline void bits_ended(struct bits_reader *bits)
 {
-	return bits->num * 8 + bits->cnt;
+	if (!bits->prefix || (bits->file && ferror(bits->file)))
+		fprintf(stderr, "could not read from file \"%s\".\n", bits->name);
 }
 
-void close_reader(struct bits_reader *bits)
+static inline void limit_reader(struct bits_reader *bits, size_t size)
 {
-	fclose(bits->file);
+	bits->end = size;
+	if (bits->base + bits->len <= size)
+		return;
+	if (bits->base + bits->pos <= size) {
+		bits->len = size - bits->base;
+		return;
+	}
+	bits->len = bits->pos;
+	int excess = 8 * (bits->base + bits->pos - size);
+	if (excess >= bits->cnt) {
+		bits->acc = 0;
+		bits->cnt = 0;
+	} else {
+		bits->cnt -= excess;
+		bits->acc &= ((uint64_t)1 << bits->cnt) - 1;
+	}
+}
+
+static inline size_t bits_offset(struct bits_reader *bits)
+{
+	return bits->base + bits->pos - bits->cnt / 8;
+}
+
+static inline void close_reader(struct bits_reader *bits)
+{
+	if (bits->file)
+		fclose(bits->file);
+	if (bits->map)
+		munmap(bits->map, bits->size);
+	free(bits->mem);
 	free(bits);
 }
 
-void close_writer(struct bits_writer *bits)
+static inline void *release_writer(struct bits_writer *bits, size_t *size)
 {
-	if (bits->cnt && bits->acc != fputc(bits->acc, bits->file))
-		fprintf(stderr, "could not write to file \"%s\".\n", bits->name);
-	fclose(bits->file);
+	if (bits->pos + 8 > bits->size)
+		bits_flush(bits);
+	int num = (bits->cnt + 7) / 8;
+	for (int i = 0; i < num; ++i)
+		bits->buf[bits->pos++] = bits->acc >> (8 * i);
+	void *data = bits->buf;
+	*size = bits->pos;
+	if (bits->file) {
+		bits_flush(bits);
+		fclose(bits->file);
+		free(data);
+		data = 0;
+		*size = 0;
+	}
 	free(bits);
+	return data;
+}
+
+static inline void close_writer(struct bits_writer *bits)
+{
+	size_t size;
+	free(release_writer(bits, &size));
 }
 
-int put_bit(struct bits_writer *bits, int b)
+static inline int put_bit(struct bits_writer *bits, int b)
 {
-	if (bits->cap > 0 && bits->num * 8 + bits->cnt >= bits->cap)
+	if (bits->cap > 0 && bits_count(bits) >= bits->cap)
 		return -2;
-	bits->acc |= !!b << bits->cnt++;
-	if (bits->cnt >= 8) {
-		bits->cnt -= 8;
-		bits->num += 1;
-		int c = bits->acc & 255;
-		bits->acc >>= 8;
-		if (c != fputc(c, bits->file)) {
-			fprintf(stderr, "could not write to file \"%s\".\n", bits->name);
-			return -1;
-		}
+	bits->acc |= (uint64_t)!!b << bits->cnt;
+	if (++bits->cnt == 64) {
+		bits->cnt = 0;
+		uint64_t word = bits->acc;
+		bits->acc = 0;
+		return bits_emit(bits, word);
 	}
 	return 0;
 }
 
-int write_bits(struct bits_writer *bits, int b, int n)
+static inline int write_bits(struct bits_writer *bits, int b, int n)
 {
-	for (int i = 0; i < n; ++i) {
-		int ret = put_bit(bits, (b>>i)&1);
-		if (ret)
-			return ret;
+	int ret = 0;
+	if (bits->cap > 0 && n > bits->cap - bits_count(bits)) {
+		n = (int)(bits->cap - bits_count(bits));
+		ret = -2;
 	}
-	return 0;
+	if (n <= 0)
+		return ret;
+	uint64_t val = (uint32_t)b & (~(uint64_t)0 >> (64 - n));
+	bits->acc |= val << bits->cnt;
+	bits->cnt += n;
+	if (bits->cnt >= 64) {
+		bits->cnt -= 64;
+		uint64_t word = bits->acc;
+		bits->acc = bits->cnt ? val >> (n - bits->cnt) : 0;
+		int err = bits_emit(bits, word);
+		if (err)
+			return err;
+	}
+	return ret;
 }
 
-int get_bit(struct bits_reader *bits)
+static inline int get_bit(struct bits_reader *bits)
 {
 	if (!bits->cnt) {
-		int c = fgetc(bits->file);
-		if (c == EOF) {
-			fprintf(stderr, "could not read from file \"%s\".\n", bits->name);
+		bits_refill(bits);
+		if (!bits->cnt) {
+			bits_ended(bits);
 			return -1;
 		}
-		bits->acc = c;
-		bits->cnt = 8;
 	}
 	int b = bits->acc & 1;
 	bits->acc >>= 1;
@@ -121,16 +341,169 @@ int get_bit(struct bits_reader *bits)
 	return b;
 }
 
-int read_bits(struct bits_reader *bits, int *b, int n)
+static inline int read_bits(struct bits_reader *bits, int *b, int n)
 {
-	int a = 0;
-	for (int i = 0; i < n; ++i) {
-		int b = get_bit(bits);
-		if (b < 0)
-			return b;
-		a |= b << i;
+	if (bits->cnt < n) {
+		bits_refill(bits);
+		if (bits->cnt < n) {
+			bits->acc = 0;
+			bits->cnt = 0;
+			bits_ended(bits);
+			return -1;
+		}
 	}
-	*b = a;
+	*b = bits->acc & (((uint64_t)1 << n) - 1);
+	bits->acc >>= n;
+	bits->cnt -= n;
 	return 0;
 }
 
+/*
+peek_bits() refills the accumulator and returns how many bits of "word"
+are available, lowest bit first, without consuming them. Bits above the
+available ones are either zero or the bits that follow in the stream.
+skip_bits() consumes "n" of the available bits.
+*/
+
+static inline int peek_bits(struct bits_reader *bits, uint64_t *word)
+{
+	if (bits->cnt < 56)
+		bits_refill(bits);
+	*word = bits->acc;
+	return bits->cnt;
+}
+
+static inline void skip_bits(struct bits_reader *bits, int n)
+{
+	bits->acc = n < 64 ? bits->acc >> n : 0;
+	bits->cnt -= n;
+}
+
+static inline int align_writer(struct bits_writer *bits)
+{
+	return write_bits(bits, 0, -bits->cnt & 7);
+}
+
+static inline int write_bytes(struct bits_writer *bits, const void *data, size_t size)
+{
+	if (bits->cnt & 7)
+		return -1;
+	if (bits->cap > 0 && bits_count(bits) + 8 * (long long)size > bits->cap)
+		return -2;
+	const uint8_t *src = data;
+	while (bits->cnt || size) {
+		if (bits->pos == bits->size) {
+			int ret = bits_flush(bits);
+			if (ret)
+				return ret;
+		}
+		if (bits->cnt) {
+			bits->buf[bits->pos++] = bits->acc;
+			bits->acc >>= 8;
+			bits->cnt -= 8;
+			bits->num += 1;
+			continue;
+		}
+		size_t num = bits->size - bits->pos;
+		if (num > size)
+			num = size;
+		memcpy(bits->buf + bits->pos, src, num);
+		bits->pos += num;
+		bits->num += num;
+		src += num;
+		size -= num;
+	}
+	return 0;
+}
+
+static inline void align_reader(struct bits_reader *bits)
+{
+	int pad = bits->cnt & 7;
+	bits->acc >>= pad;
+	bits->cnt -= pad;
+}
+
+static inline int read_bytes(struct bits_reader *bits, void *data, size_t size)
+{
+	if (bits->cnt & 7)
+		return -1;
+	uint8_t *dst = data;
+	for (; bits->cnt && size; --size, bits->cnt -= 8, bits->acc >>= 8)
+		*dst++ = bits->acc;
+	if (!size)
+		return 0;
+	bits->acc = 0;
+	while (size) {
+		if (bits->pos == bits->len) {
+			bits_fill(bits);
+			if (bits->pos == bits->len) {
+				bits_ended(bits);
+				return -1;
+			}
+		}
+		size_t num = bits->len - bits->pos;
+		if (num > size)
+			num = size;
+		memcpy(dst, bits->buf + bits->pos, num);
+		bits->pos += num;
+		dst += num;
+		size -= num;
+	}
+	return 0;
+}
+
+/*
+map_prefix() maps up to "size" bytes like map_bytes() does, for streams
+that might have been cut short, and reduces "size" to the bytes mapped.
+*/
+
+static inline const void *map_prefix(struct bits_reader *bits, size_t *size)
+{
+	if (bits->file || bits->cnt & 7) {
+		*size = 0;
+		return 0;
+	}
+	bits->pos -= bits->cnt / 8;
+	bits->acc = 0;
+	bits->cnt = 0;
+	if (*size > bits->len - bits->pos)
+		*size = bits->len - bits->pos;
+	const void *data = bits->buf + bits->pos;
+	bits->pos += *size;
+	return data;
+}
+
+static inline const void *map_bytes(struct bits_reader *bits, size_t size)
+{
+	if (bits->file || bits->cnt & 7)
+		return 0;
+	bits->pos -= bits->cnt / 8;
+	bits->acc = 0;
+	bits->cnt = 0;
+	if (bits->len - bits->pos < size)
+		return 0;
+	const void *data = bits->buf + bits->pos;
+	bits->pos += size;
+	return data;
+}
+
+/*
+input_bytes() gives all bytes of a reader. Regular files are mapped, so
+that decoding a prefix only reads the pages it needs, everything else is
+read into "buffer" until the end of input.
+*/
+
+static inline const uint8_t *input_bytes(struct bits_reader *bits, uint8_t **buffer, size_t *size)
+{
+	if (bits->map) {
+		*size = bits->size;
+		return bits->buf;
+	}
+	size_t len = 0, max = BITS_BUFFER;
+	uint8_t *buf = malloc(max);
+	for (size_t num; (num = fread(buf + len, 1, max - len, bits->file));)
+		if ((len += num) == max)
+			buf = realloc(buf, max *= 2);
+	*size = len;
+	return *buffer = buf;
+}
@@ -0,0 +1,62 @@
+/*
+Sharing a budget among the tiles of a picture
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdlib.h>
+#include "bits.h"
+#include "vli.h"
+
+/*
+budget_head() gives the number of the "size" bytes at "data" up to the
+end of the roots and the planes of a tile, after "header" numbers of the
+stream in front of them. A tile can not be cut shorter and still decode.
+If the stream ends before, all of it is needed.
+*/
+
+static inline long long budget_head(const uint8_t *data, size_t size, int header)
+{
+	struct bits_reader *bits = bits_reader_memory(data, size, "budget");
+	struct vli_reader *vli = vli_reader(bits);
+	bits->prefix = 1;
+	int ret = 0;
+	for (int i = 0; ret >= 0 && i < header + 6; ++i)
+		if ((ret = get_vli(vli)) > 0 && i >= header && i < header + 3)
+			ret = vli_get_bit(vli);
+	long long bytes = ret < 0 ? (long long)size : (long long)bits_offset(bits);
+	delete_vli_reader(vli);
+	close_reader(bits);
+	return bytes;
+}
+
+/*
+budget_tiles() cuts the "sizes" of "num" tiles, which follow each other
+at "data", down to "bytes" in all. Every tile keeps its head and the
+rest is shared in proportion to what the tiles have beyond their heads,
+so no tile gets more than its size. Returns -1 if the heads alone need
+more than "bytes", as the tiles can not be cut to fit then.
+*/
+
+static inline int budget_tiles(const uint8_t *data, size_t *sizes, int num, long long bytes)
+{
+	size_t total = 0;
+	for (int i = 0; i < num; ++i)
+		total += sizes[i];
+	if (bytes >= (long long)total)
+		return 0;
+	size_t *heads = malloc(sizeof(size_t) * num), need = 0;
+	for (int i = 0; i < num; ++i) {
+		heads[i] = budget_head(data, sizes[i], 0);
+		need += heads[i];
+		data += sizes[i];
+	}
+	long long rest = bytes - (long long)need;
+	if (rest >= 0)
+		for (int i = 0; i < num; ++i)
+			sizes[i] = heads[i] + (__int128)(sizes[i] - heads[i]) * rest / (total - need);
+	free(heads);
+	return rest < 0 ? -1 : 0;
+}
@@ -0,0 +1,32 @@
+/*
+Buffers kept by a codec context from one picture to the next
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "arena.h"
+#include "pool.h"
+#include "stats.h"
+
+/*
+"stats" holds the statistics of the last call, of which "report" is
+the text made by lqt_report(). "name" is the name given by lqt_name().
+The workers of "pool" are started by the first call that needs them and
+joined by lqt_delete().
+*/
+
+struct lqt {
+	const char *name;
+	struct arena arena;
+	struct pool pool;
+	uint8_t *data;
+	size_t data_size;
+	uint8_t *pixels;
+	size_t pixels_size;
+	struct stats stats;
+	char *report;
+	size_t report_size;
+};
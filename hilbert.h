@@ -7,24 +7,28 @@ https://en.wikipedia.org/wiki/Hilbert_curve
 Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
 */
 
-int hilbert(int n, int d)
-{
-	int x = 0, y = 0;
-	for (int s = 1; s < n; s *= 2, d /= 4) {
-		int rx = (d/2) & 1;
-		int ry = (d^rx) & 1;
-		if (ry == 0) {
-			if (rx == 1) {
-				x = s-1 - x;
-				y = s-1 - y;
-			}
-			x ^= y;
-			y ^= x;
-			x ^= y;
-		}
-		x += s * rx;
-		y += s * ry;
-	}
-	return n * y + x;
-}
+#pragma once
+
+/*
+The curve of length 2n visits the four children of every cell of the
+curve of length n one after another, so the quadtree levels can stay in
+Hilbert order. Walking the curve needs only the orientation of the
+current quadrant: hilbert_quad[s][k] is the (x + 2 * y) offset of the
+k-th child quadrant and hilbert_next[s][k] its orientation, starting
+with orientation zero.
+*/
+
+static const int hilbert_quad[4][4] = {
+	{ 0, 2, 3, 1 },
+	{ 0, 1, 3, 2 },
+	{ 3, 2, 0, 1 },
+	{ 3, 1, 0, 2 },
+};
+
+static const int hilbert_next[4][4] = {
+	{ 1, 0, 0, 2 },
+	{ 0, 1, 1, 3 },
+	{ 3, 2, 2, 0 },
+	{ 2, 3, 3, 1 },
+};
 
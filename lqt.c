@@ -0,0 +1,128 @@
+/*
+Codec contexts of the library
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "lqt.h"
+#include "context.h"
+
+__thread int lqt_pool_inside;
+
+struct lqt *lqt_new(void)
+{
+	struct lqt *lqt = calloc(1, sizeof(struct lqt));
+	lqt->name = "memory";
+	return lqt;
+}
+
+void lqt_name(struct lqt *lqt, const char *name)
+{
+	lqt->name = name ? name : "memory";
+}
+
+void lqt_delete(struct lqt *lqt)
+{
+	if (!lqt)
+		return;
+	arena_release(&lqt->arena);
+	pool_stop(&lqt->pool);
+	free(lqt->data);
+	free(lqt->pixels);
+	free(lqt->report);
+	free(lqt);
+}
+
+static void report(struct lqt *lqt, size_t *len, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int num = vsnprintf(lqt->report + *len, lqt->report_size - *len, format, args);
+	va_end(args);
+	if (*len + num >= lqt->report_size) {
+		lqt->report_size = 2 * (*len + num + 1);
+		lqt->report = realloc(lqt->report, lqt->report_size);
+		va_start(args, format);
+		vsnprintf(lqt->report + *len, lqt->report_size - *len, format, args);
+		va_end(args);
+	}
+	*len += num;
+}
+
+static void report_list(struct lqt *lqt, size_t *len, const char *name, long long *list, int num)
+{
+	while (num > 0 && !list[num-1])
+		--num;
+	report(lqt, len, ",\n\"%s\": [", name);
+	for (int i = 0; i < num; ++i)
+		report(lqt, len, "%s%lld", i ? ", " : "", list[i]);
+	report(lqt, len, "]");
+}
+
+/*
+The bits of the passes are summed up for each channel, level and plane.
+Only the run length coding writes a sign or refinement as a single bit,
+so only then the bits of the significance passes are known, as the rest.
+*/
+
+const char *lqt_report(struct lqt *lqt)
+{
+	struct stats *stats = &lqt->stats;
+	size_t len = 0;
+	if (!lqt->report_size) {
+		lqt->report_size = 4096;
+		lqt->report = malloc(lqt->report_size);
+	}
+	report(lqt, &len, "{\n\"mode\": %d,\n\"width\": %d,\n\"height\": %d,\n\"tile\": %d,\n\"capacity\": %lld,\n\"bits\": %lld,\n\"nanoseconds\": {",
+		stats->mode, stats->width, stats->height, stats->tile, stats->capacity, 8 * stats->bytes);
+	for (int stage = 0; stage < STAGES; ++stage)
+		report(lqt, &len, "%s\"%s\": %lld", stage ? ", " : "", stage_name(stage), stats->nanos[stage]);
+	report(lqt, &len, "}");
+	long long channels[3] = { 0 }, levels[STATS_LEVELS] = { 0 }, planes[STATS_PLANES] = { 0 };
+	long long bits = 0, signs = 0, refinements = 0;
+	for (int chan = 0; chan < 3; ++chan) {
+		for (int level = 0; level < STATS_LEVELS; ++level) {
+			for (int plane = 0; plane < STATS_PLANES; ++plane) {
+				channels[chan] += stats->bits[chan][level][plane];
+				levels[level] += stats->bits[chan][level][plane];
+				planes[plane] += stats->bits[chan][level][plane];
+				bits += stats->bits[chan][level][plane];
+				signs += stats->signs[chan][level][plane];
+				refinements += stats->refinements[chan][level][plane];
+			}
+		}
+	}
+	report_list(lqt, &len, "channels", channels, 3);
+	report_list(lqt, &len, "levels", levels, STATS_LEVELS);
+	report_list(lqt, &len, "planes", planes, STATS_PLANES);
+	report(lqt, &len, ",\n\"signs\": %lld,\n\"refinements\": %lld", signs, refinements);
+	if (!(stats->mode & 4))
+		report(lqt, &len, ",\n\"significance_bits\": %lld", bits - signs - refinements);
+	report_list(lqt, &len, "runs", stats->runs, STATS_RUNS);
+	report(lqt, &len, ",\n\"cuts\": [");
+	for (int layer = 0, first = 1; layer < STATS_LAYERS; ++layer) {
+		if (!stats->cuts[layer])
+			continue;
+		report(lqt, &len, "%s{\"layer\": %d, \"tiles\": %lld}", first ? "" : ", ", layer, stats->cuts[layer]);
+		first = 0;
+	}
+	report(lqt, &len, "],\n\"passes\": [");
+	for (int chan = 0, first = 1; chan < 3; ++chan) {
+		for (int level = 0; level < STATS_LEVELS; ++level) {
+			for (int plane = STATS_PLANES-1; plane >= 0; --plane) {
+				long long *bits = &stats->bits[chan][level][plane];
+				long long *signs = &stats->signs[chan][level][plane];
+				long long *refinements = &stats->refinements[chan][level][plane];
+				if (!*bits && !*signs && !*refinements)
+					continue;
+				report(lqt, &len, "%s\n{\"channel\": %d, \"level\": %d, \"plane\": %d, \"bits\": %lld, \"signs\": %lld, \"refinements\": %lld}",
+					first ? "" : ",", chan, level, plane, *bits, *signs, *refinements);
+				first = 0;
+			}
+		}
+	}
+	report(lqt, &len, "\n]\n}\n");
+	return lqt->report;
+}
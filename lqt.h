@@ -0,0 +1,78 @@
+/*
+Library interface for lossless image compression based on the quadtree data structure
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+A context keeps the buffers and the worker threads of the codec from one
+picture to the next, lqt_delete() frees the buffers and ends the threads.
+Pictures are 8 bit RGB, three bytes per pixel and row after row.
+The arguments "mode", "capacity", "tile", "shrink" and "budget" are the
+same as the arguments of the encode and decode commands, with a budget
+given in bits or -1 for the whole stream. The returned stream or picture
+belongs to the context and stays valid until its next use. A context can
+be used by one thread at a time, while different contexts run in
+parallel. Both functions return zero on success.
+*/
+
+struct lqt;
+
+struct lqt *lqt_new(void);
+
+void lqt_delete(struct lqt *lqt);
+
+/*
+lqt_name() gives the name of the stream or picture of the next calls,
+so that their messages of errors name the file instead of "memory".
+The name is not copied and has to stay valid while it is used.
+*/
+
+void lqt_name(struct lqt *lqt, const char *name);
+
+int lqt_encode(struct lqt *lqt, const uint8_t *pixels, int width, int height, int mode, long long capacity, int tile, const uint8_t **data, size_t *size);
+
+/*
+lqt_encode_rows() reads the picture while it encodes it: "read" fills
+"pixels" with the next "rows" rows of the picture and returns zero on
+success. With tiles, only a few rows of tiles of the picture are kept in
+memory, while the returned stream grows with the picture.
+*/
+
+int lqt_encode_rows(struct lqt *lqt, int (*read)(void *arg, uint8_t *pixels, int rows), void *arg, int width, int height, int mode, long long capacity, int tile, const uint8_t **data, size_t *size);
+
+int lqt_decode(struct lqt *lqt, const uint8_t *data, size_t size, int shrink, long long budget, const uint8_t **pixels, int *width, int *height);
+
+/*
+lqt_truncate() cuts a stream to "budget" bits without decoding it, so
+that the result decodes like the whole stream decoded with that budget.
+Streams coded with mode 8 or 16 carry an index of their layers, which
+also allows to keep only the first "layers" layers of each tile, other
+streams only allow a budget and "layers" must be -1. The cut stream
+belongs to the context like the encoded one.
+*/
+
+int lqt_truncate(struct lqt *lqt, const uint8_t *input, size_t size, long long budget, int layers, const uint8_t **data, size_t *output_size);
+
+/*
+lqt_report() describes the last call of lqt_encode() in JSON: the time
+spent in each stage, the bits spent on each channel, level, plane and
+pass, the numbers of sign and refinement bits, a histogram of the run
+lengths by their number of bits and the layers where the capacity cut
+the stream. The text belongs to the context like the stream.
+*/
+
+const char *lqt_report(struct lqt *lqt);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,830 @@
+/*
+Decoder for lossless image compression based on the quadtree data structure
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#include "lqt.h"
+#include "context.h"
+#include "rle.h"
+#include "rac.h"
+#include "vli.h"
+#include "bits.h"
+#include "quadtree.h"
+#include "budget.h"
+#include "pyramid.h"
+#include "pool.h"
+#include "stats.h"
+
+static void restore_nodes(int16_t *node, int16_t *child, int *edge, int *last, int begin, int end)
+{
+	for (int i = begin; i < end; ++i) {
+		int next = edge < last && *edge < end ? *edge : end;
+		restore(node+i, child, next-i);
+		child += 4 * (next-i);
+		i = next;
+		if (i == end)
+			break;
+		int cnt = edge[1];
+		edge += 2;
+		for (int k = 0; k < cnt; ++k)
+			child[k] += node[i];
+		child += cnt;
+	}
+}
+
+static void doit(int16_t *tree, struct quadtree *qt, int level, int begin, int end)
+{
+	int *edge, *last = qt->edge[level] + 2 * qt->edges[level];
+	int16_t *child = tree + qt->offset[level+1] + first_child(qt, level, begin, &edge);
+	restore_nodes(tree + qt->offset[level], child, edge, last, begin, end);
+}
+
+static uint8_t clamp(int x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+/*
+emit() writes the pixels of the leaves to the bytes of the picture,
+undoing the centering and the color transform of the three channels.
+*/
+
+static void emit(uint8_t *restrict output, const int16_t *Y, const int16_t *U, const int16_t *V, const int *leaf, int mode, int begin, int end)
+{
+	if (mode & 1) {
+		for (int i = begin; i < end; ++i) {
+			uint8_t *pixel = output + 3 * (size_t)leaf[i];
+			int G = Y[i] + 128 - (U[i] + V[i] + 512) / 4 + 128;
+			pixel[0] = clamp(U[i] + G);
+			pixel[1] = clamp(G);
+			pixel[2] = clamp(V[i] + G);
+		}
+	} else {
+		for (int i = begin; i < end; ++i) {
+			uint8_t *pixel = output + 3 * (size_t)leaf[i];
+			pixel[0] = clamp(Y[i] + 128);
+			pixel[1] = clamp(U[i] + 128);
+			pixel[2] = clamp(V[i] + 128);
+		}
+	}
+}
+
+/*
+The coefficients are magnitudes, the signs and the "significant" and
+"refine" flags are kept in bitmaps with one bit for each coefficient.
+The passes only visit the coefficients they code, skipping 64 at once,
+and "count" keeps track of the refined coefficients of each level, so
+that passes with nothing to code are skipped completely.
+*/
+
+struct coefs {
+	int16_t *val;
+	uint64_t *sgn;
+	uint64_t *sig;
+	uint64_t *ref;
+	uint64_t *zt[2];
+	uint64_t *busy;
+	uint16_t *prob;
+	int *count;
+};
+
+static uint64_t word_mask(int first, int last, int w)
+{
+	uint64_t mask = ~(uint64_t)0;
+	if (w == first / 64)
+		mask &= ~(uint64_t)0 << (first % 64);
+	if (w == last / 64)
+		mask &= ~(uint64_t)0 >> (63 - last % 64);
+	return mask;
+}
+
+static int refinement(struct rle_reader *rle, struct coefs *c, int first, int num, int plane, int *count, int fresh)
+{
+	int last = first + num - 1;
+	for (int w = first / 64; (*count || fresh) && w <= last / 64; ++w) {
+		uint64_t mask = word_mask(first, last, w);
+		for (uint64_t todo = *count ? mask & c->ref[w] : 0; todo; todo &= todo - 1) {
+			int b = __builtin_ctzll(todo);
+			int bit = rle_get_bit(rle);
+			if (bit < 0)
+				return bit;
+			c->val[64*w+b] |= bit << plane;
+		}
+		c->ref[w] |= c->sig[w] & mask;
+		c->sig[w] &= ~mask;
+	}
+	*count += fresh;
+	return 0;
+}
+
+static int signify(struct rle_reader *rle, struct coefs *c, int i)
+{
+	int neg = rle_get_bit(rle);
+	if (neg < 0)
+		return neg;
+	c->sgn[i/64] |= (uint64_t)neg << (i%64);
+	c->sig[i/64] |= (uint64_t)1 << (i%64);
+	return 1;
+}
+
+static int significant(struct rle_reader *rle, struct coefs *c, int i, int plane)
+{
+	int bit = get_rle(rle);
+	if (bit < 0)
+		return bit;
+	c->val[i] |= bit << plane;
+	if (bit)
+		return signify(rle, c, i);
+	return 0;
+}
+
+/*
+The significance pass hands over a word of coefficients at once,
+so that runs of zeros are skipped and not decoded one by one.
+*/
+
+static int decode(struct rle_reader *rle, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	int first = qt->offset[layer+1], num = qt->size[layer+1];
+	int *count = c->count + layer;
+	int last = first + num - 1;
+	int fresh = 0;
+	for (int w = first / 64; *count < num && w <= last / 64; ++w) {
+		uint64_t todo = word_mask(first, last, w) & ~c->ref[w];
+		while (1) {
+			int b = rle_get_mask(rle, &todo);
+			if (b < 0)
+				return b;
+			if (b == 64)
+				break;
+			c->val[64*w+b] |= 1 << plane;
+			int ret = signify(rle, c, 64 * w + b);
+			if (ret < 0)
+				return ret;
+			++fresh;
+		}
+	}
+	return refinement(rle, c, first, num, plane, count, fresh);
+}
+
+/*
+In the zero tree mode, the significance pass of a coefficient is
+followed by a bit telling if any of its descendants is significant at
+this plane. If none is, the descendants are known to be zero at this
+plane and are skipped, when their levels get to code this plane.
+Once a descendant is significant, it stays so for the lower planes
+and the bit is not needed anymore, which is what "busy" remembers.
+Coefficients with only children or grandchildren are not worth the bit.
+The flags for the even and odd planes are kept apart, as a level codes
+the next plane before its children get to code this one.
+*/
+
+static int decode_zerotree(struct rle_reader *rle, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	int first = qt->offset[layer+1], num = qt->size[layer+1];
+	int *count = c->count + layer;
+	uint64_t *zt = c->zt[plane&1];
+	int *edge = qt->edge[layer], *last = edge + 2 * qt->edges[layer];
+	int small = layer+2 >= qt->depth;
+	int fresh = 0;
+	for (int i = 0, child = first; i < qt->size[layer]; ++i) {
+		int cnt = 4;
+		if (edge < last && *edge == i) {
+			cnt = edge[1];
+			edge += 2;
+		}
+		int parent = qt->offset[layer] + i;
+		int skip = layer && (zt[parent/64] >> (parent%64)) & 1;
+		for (int end = child + cnt; child < end; ++child) {
+			uint64_t bit = (uint64_t)1 << (child%64);
+			if (skip) {
+				zt[child/64] |= bit;
+				continue;
+			}
+			zt[child/64] &= ~bit;
+			if (!(c->ref[child/64] & bit)) {
+				int ret = significant(rle, c, child, plane);
+				if (ret < 0)
+					return ret;
+				fresh += ret;
+			}
+			if (small || c->busy[child/64] & bit)
+				continue;
+			int busy = get_rle(rle);
+			if (busy < 0)
+				return busy;
+			if (busy)
+				c->busy[child/64] |= bit;
+			else
+				zt[child/64] |= bit;
+		}
+	}
+	return refinement(rle, c, first, num, plane, count, fresh);
+}
+
+/*
+In the arithmetic coding mode, all bits of the passes are coded with
+adaptive probabilities, which are kept apart for each channel and level.
+Significance bits are told apart by the significance of the parent and of
+the preceding coefficient, which is a neighbour in the Hilbert order.
+Signs are told apart by the sign of a significant preceding coefficient
+and refinement bits by being the first refinement of a coefficient.
+*/
+
+enum { CTX_SIG = 0, CTX_SGN = 4, CTX_REF = 7, CTX_BUSY = 9, CONTEXTS = 11 };
+
+static int flag(uint64_t *map, int i)
+{
+	return (map[i/64] >> (i%64)) & 1;
+}
+
+static int refinement_arith(struct rac_reader *rac, struct coefs *c, uint16_t *prob, int first, int num, int plane, int *count, int fresh)
+{
+	int last = first + num - 1;
+	for (int w = first / 64; (*count || fresh) && w <= last / 64; ++w) {
+		uint64_t mask = word_mask(first, last, w);
+		for (uint64_t todo = *count ? mask & c->ref[w] : 0; todo; todo &= todo - 1) {
+			int i = 64 * w + __builtin_ctzll(todo);
+			int bit = get_rac(rac, prob + CTX_REF + (c->val[i] >> (plane+1) == 1));
+			if (bit < 0)
+				return bit;
+			c->val[i] |= bit << plane;
+		}
+		c->ref[w] |= c->sig[w] & mask;
+		c->sig[w] &= ~mask;
+	}
+	*count += fresh;
+	return 0;
+}
+
+static int significant_arith(struct rac_reader *rac, struct coefs *c, uint16_t *prob, int i, int plane, int above, int left)
+{
+	int bit = get_rac(rac, prob + CTX_SIG + 2 * above + left);
+	if (bit < 0)
+		return bit;
+	c->val[i] |= bit << plane;
+	if (bit) {
+		int ctx = left ? 1 + flag(c->sgn, i-1) : 0;
+		int neg = get_rac(rac, prob + CTX_SGN + ctx);
+		if (neg < 0)
+			return neg;
+		c->sgn[i/64] |= (uint64_t)neg << (i%64);
+		c->sig[i/64] |= (uint64_t)1 << (i%64);
+	}
+	return bit;
+}
+
+static int decode_arith(struct rac_reader *rac, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	int first = qt->offset[layer+1], num = qt->size[layer+1];
+	int *count = c->count + layer;
+	uint64_t *zt = c->busy ? c->zt[plane&1] : 0;
+	int *edge = qt->edge[layer], *last = edge + 2 * qt->edges[layer];
+	int small = !zt || layer+2 >= qt->depth;
+	uint16_t *prob = c->prob + CONTEXTS * (layer+1);
+	int fresh = 0;
+	for (int i = 0, child = first; i < qt->size[layer] && (zt || *count < num); ++i) {
+		int cnt = 4;
+		if (edge < last && *edge == i) {
+			cnt = edge[1];
+			edge += 2;
+		}
+		int parent = qt->offset[layer] + i;
+		int skip = zt && layer && flag(zt, parent);
+		int above = flag(c->ref, parent) | flag(c->sig, parent);
+		for (int end = child + cnt; child < end; ++child) {
+			uint64_t bit = (uint64_t)1 << (child%64);
+			if (skip) {
+				zt[child/64] |= bit;
+				continue;
+			}
+			if (zt)
+				zt[child/64] &= ~bit;
+			if (!(c->ref[child/64] & bit)) {
+				int left = child > first && (flag(c->ref, child-1) | flag(c->sig, child-1));
+				int ret = significant_arith(rac, c, prob, child, plane, above, left);
+				if (ret < 0)
+					return ret;
+				fresh += ret;
+			}
+			if (small || c->busy[child/64] & bit)
+				continue;
+			int busy = get_rac(rac, prob + CTX_BUSY + !!(c->ref[child/64] & bit) + !!(c->sig[child/64] & bit));
+			if (busy < 0)
+				return busy;
+			if (busy)
+				c->busy[child/64] |= bit;
+			else
+				zt[child/64] |= bit;
+		}
+	}
+	return refinement_arith(rac, c, prob, first, num, plane, count, fresh);
+}
+
+static int code(struct rle_reader *rle, struct rac_reader *rac, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	if (rac)
+		return decode_arith(rac, c, qt, layer, plane);
+	if (c->busy)
+		return decode_zerotree(rle, c, qt, layer, plane);
+	return decode(rle, c, qt, layer, plane);
+}
+
+static int decode_root(struct vli_reader *vli, int *root)
+{
+	int ret = get_vli(vli);
+	if (ret < 0)
+		return ret;
+	*root = ret;
+	if (!ret)
+		return 0;
+	if ((ret = vli_get_bit(vli)) < 0)
+		return ret;
+	if (ret)
+		*root = - *root;
+	return 0;
+}
+
+static void process(int16_t *val, uint64_t *sgn, int begin, int end)
+{
+	for (int i = begin; i < end; ++i)
+		if ((sgn[i/64] >> (i%64)) & 1)
+			val[i] = -val[i];
+}
+
+/*
+Levels of the tree below the level "levels" are only decoded as far as
+the stream order demands and are left out of the reconstruction, which
+then ends with the averages at that level. The first "levels" levels of
+a picture are the levels of the same picture scaled down by a power of
+two, so "thumb" is the quadtree for that smaller picture.
+*/
+
+struct tile {
+	int16_t *tree;
+	uint64_t *flags;
+	int tree_size;
+	int words;
+	int levels;
+	int mode;
+	struct quadtree *qt;
+	struct quadtree *thumb;
+	long long *nanos;
+};
+
+static void init_tile(struct tile *tile, int width, int height, int pitch, int shrink, int mode, long long *nanos)
+{
+	tile->mode = mode;
+	tile->nanos = nanos;
+	tile->tree = 0;
+	tile->flags = 0;
+	tile->tree_size = 0;
+	tile->words = 0;
+	tile->qt = get_quadtree(width, height, pitch);
+	tile->levels = tile->qt->depth > shrink ? tile->qt->depth - shrink : 0;
+	int thumb_width = (width + (1LL << shrink) - 1) >> shrink;
+	int thumb_height = (height + (1LL << shrink) - 1) >> shrink;
+	tile->thumb = get_quadtree(thumb_width, thumb_height, pitch);
+}
+
+/*
+decode_layers() decodes the passes of the channels from "first" to
+"last" that belong to the given layers, level by level.
+*/
+
+static int decode_layers(struct rle_reader *rle, struct rac_reader *rac, struct coefs *coefs, struct quadtree *qt, int *planes, int first, int last, int layers, int deepest, int planes_max)
+{
+	for (int layer = 0; layer < deepest; ++layer) {
+		for (int chan = first; chan < last; ++chan) {
+			int plane = planes_max-1 - (layers-layer);
+			if (plane < 0 || plane >= planes[chan])
+				continue;
+			if (code(rle, rac, coefs+chan, qt, layer, plane))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void open_coder(struct vli_reader *vli, int mode, struct rle_reader **rle, struct rac_reader **rac)
+{
+	*rle = 0;
+	*rac = 0;
+	if (mode & 4)
+		*rac = rac_reader(vli->bits);
+	else
+		*rle = rle_reader(vli);
+}
+
+static void close_coder(struct rle_reader *rle, struct rac_reader *rac)
+{
+	if (rac)
+		delete_rac_reader(rac);
+	else
+		delete_rle_reader(rle);
+}
+
+/*
+The chunks of each substream, as far as they are needed and were kept,
+are put back together, and the substreams are decoded in parallel. A
+table that was cut short counts as chunks of no length. The coder starts
+afresh with each chunk that has passes, as the encoder finished it at
+the end of each layer, so the one closing the run of zeros flushed at
+the end of a chunk is not expected.
+*/
+
+struct substreams {
+	const char *name;
+	struct tile *tile;
+	struct coefs *coefs;
+	int *planes;
+	int streams;
+	int layers;
+	int deepest;
+	int planes_max;
+	uint8_t *data[3];
+	size_t size[3];
+};
+
+static int has_passes(struct substreams *sub, int stream, int layers)
+{
+	int first = sub->streams > 1 ? stream : 0, last = sub->streams > 1 ? stream+1 : 3;
+	for (int layer = 0; layer < sub->tile->qt->depth && layer <= layers; ++layer) {
+		for (int chan = first; chan < last; ++chan) {
+			int plane = sub->planes_max-1 - (layers-layer);
+			if (plane >= 0 && plane < sub->planes[chan])
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static int decode_substream(struct rle_reader *rle, struct rac_reader *rac, struct substreams *sub, int stream, int layers)
+{
+	struct quadtree *qt = sub->tile->qt;
+	if (sub->streams > 1)
+		return decode_layers(rle, rac, sub->coefs, qt, sub->planes, stream, stream+1, layers, sub->deepest, sub->planes_max);
+	return decode_layers(rle, rac, sub->coefs, qt, sub->planes, 0, 1, layers, sub->deepest, sub->planes_max) || decode_layers(rle, rac, sub->coefs, qt, sub->planes, 1, 3, layers, sub->deepest, sub->planes_max);
+}
+
+static void substream_worker(void *arg, int stream)
+{
+	struct substreams *sub = arg;
+	struct bits_reader *bits = bits_reader_memory(sub->data[stream], sub->size[stream], sub->name);
+	bits->prefix = 1;
+	struct vli_reader *vli = vli_reader(bits);
+	struct rle_reader *rle;
+	struct rac_reader *rac;
+	for (int layers = 0; layers < sub->layers; ++layers) {
+		if (!has_passes(sub, stream, layers))
+			continue;
+		open_coder(vli, sub->tile->mode, &rle, &rac);
+		int ret = decode_substream(rle, rac, sub, stream, layers);
+		if (rle)
+			rle->cnt = 0;
+		close_coder(rle, rac);
+		if (ret)
+			break;
+		align_reader(bits);
+	}
+	delete_vli_reader(vli);
+	close_reader(bits);
+}
+
+static void decode_substreams(struct vli_reader *vli, struct substreams *sub, int layers_max)
+{
+	if (layers_max < 1)
+		return;
+	int streams = sub->streams, num = streams * layers_max;
+	size_t *length = calloc(num, sizeof(size_t)), total = 0;
+	for (int i = 0; i < num; ++i) {
+		long long len = get_vli_long(vli);
+		if (len < 0)
+			break;
+		length[i] = len;
+		total += len;
+	}
+	align_reader(vli->bits);
+	const uint8_t *data = map_prefix(vli->bits, &total);
+	size_t pos = 0;
+	for (int i = 0; i < streams * sub->layers; ++i) {
+		length[i] = total - pos < length[i] ? total - pos : length[i];
+		sub->size[i%streams] += length[i];
+		pos += length[i];
+	}
+	for (int stream = 0; stream < streams; ++stream) {
+		sub->data[stream] = malloc(sub->size[stream] + 1);
+		sub->size[stream] = 0;
+	}
+	pos = 0;
+	for (int i = 0; i < streams * sub->layers; ++i) {
+		memcpy(sub->data[i%streams] + sub->size[i%streams], data + pos, length[i]);
+		sub->size[i%streams] += length[i];
+		pos += length[i];
+	}
+	free(length);
+	pool_run(substream_worker, sub, streams);
+	for (int stream = 0; stream < streams; ++stream)
+		free(sub->data[stream]);
+}
+
+/*
+The roots and the planes have to be there, but the layers after them
+may end anywhere, as the stream is embedded, so running out of them is
+not reported.
+*/
+
+static int decode_tile(struct vli_reader *vli, struct tile *tile)
+{
+	long long start = timer_now();
+	int depth = tile->qt->depth;
+	int *size = tile->qt->size;
+	int roots[3];
+	for (int chan = 0; chan < 3; ++chan)
+		if (decode_root(vli, roots+chan))
+			return -1;
+	int planes[3];
+	for (int chan = 0; chan < 3; ++chan)
+		if ((planes[chan] = get_vli(vli)) < 0 || planes[chan] > 15)
+			return -1;
+	int planes_max = 0;
+	for (int chan = 0; chan < 3; ++chan)
+		if (planes_max < planes[chan])
+			planes_max = planes[chan];
+	vli->bits->prefix = 1;
+	int maximum = depth > planes_max ? depth : planes_max;
+	int layers_max = 2 * maximum - 1;
+	int levels = tile->levels;
+	int stop = layers_max - 1;
+	if (levels < depth)
+		stop = levels ? planes_max + levels - 2 : -1;
+	int deepest = stop + 1 < depth ? stop + 1 : depth;
+	if (deepest < levels)
+		deepest = levels;
+	int *offset = tile->qt->offset;
+	int tree_size = offset[deepest] + size[deepest];
+	int16_t *tree = arena_calloc(ARENA_TREE, 3 * (size_t)tree_size, sizeof(int16_t));
+	for (int chan = 0; chan < 3; ++chan)
+		tree[(size_t)chan*tree_size] = roots[chan];
+	int words = (tree_size + 63) / 64;
+	uint64_t *flags = arena_calloc(ARENA_FLAGS, (tile->mode & 2 ? 6 : 3) * 3 * words, sizeof(uint64_t));
+	tile->tree = tree;
+	tile->flags = flags;
+	tile->tree_size = tree_size;
+	tile->words = words;
+	uint16_t *prob = 0;
+	if (tile->mode & 4) {
+		prob = malloc(sizeof(uint16_t) * 3 * (depth + 1) * CONTEXTS);
+		rac_probs(prob, 3 * (depth + 1) * CONTEXTS);
+	}
+	int *count = calloc(3 * depth + 1, sizeof(int));
+	struct coefs coefs[3];
+	for (int chan = 0; chan < 3; ++chan) {
+		struct coefs *c = coefs + chan;
+		c->val = tree + (size_t)chan * tree_size;
+		c->sgn = flags + chan * words;
+		c->sig = c->sgn + 3 * words;
+		c->ref = c->sig + 3 * words;
+		c->zt[0] = c->zt[1] = c->busy = 0;
+		if (tile->mode & 2) {
+			c->zt[0] = c->ref + 3 * words;
+			c->zt[1] = c->zt[0] + 3 * words;
+			c->busy = c->zt[1] + 3 * words;
+		}
+		c->prob = prob ? prob + chan * (depth + 1) * CONTEXTS : 0;
+		c->count = count + chan * depth;
+	}
+	int layers = layers_max < stop + 1 ? layers_max : stop + 1;
+	if (tile->mode & 24) {
+		struct substreams sub = { vli->bits->name, tile, coefs, planes, tile->mode & 8 ? 3 : 1, layers, deepest, planes_max, { 0 }, { 0 } };
+		decode_substreams(vli, &sub, layers_max);
+	} else {
+		struct rle_reader *rle;
+		struct rac_reader *rac;
+		open_coder(vli, tile->mode, &rle, &rac);
+		int done = 0;
+		while (done < layers && !decode_layers(rle, rac, coefs, tile->qt, planes, 0, 1, done, deepest, planes_max) && !decode_layers(rle, rac, coefs, tile->qt, planes, 1, 3, done, deepest, planes_max))
+			++done;
+		if (rle && stop < layers_max - 1 && done == layers)
+			rle->cnt = 0;
+		close_coder(rle, rac);
+	}
+	free(prob);
+	free(count);
+	timer_stage(tile->nanos, STAGE_CODE, start);
+	return 0;
+}
+
+struct stage {
+	int16_t *tree;
+	uint64_t *sgn;
+	int tree_size;
+	int words;
+	uint8_t *output;
+	struct quadtree *qt;
+	int level;
+	int mode;
+};
+
+static void process_worker(void *arg, int chan, int begin, int end)
+{
+	struct stage *stage = arg;
+	process(stage->tree+(size_t)chan*stage->tree_size, stage->sgn+chan*stage->words, 1+begin, 1+end);
+}
+
+static void doit_worker(void *arg, int chan, int begin, int end)
+{
+	struct stage *stage = arg;
+	doit(stage->tree+(size_t)chan*stage->tree_size, stage->qt, stage->level, begin, end);
+}
+
+/*
+The last level is restored for all three channels and written out in
+blocks of nodes, so the leaves are still in the cache when their pixels
+are written.
+*/
+
+#define BLOCK 1024
+
+static void emit_worker(void *arg, int part, int begin, int end)
+{
+	(void)part;
+	struct stage *stage = arg;
+	struct quadtree *qt = stage->qt;
+	int level = stage->level;
+	size_t size = stage->tree_size;
+	int16_t *node = stage->tree + qt->offset[level];
+	int16_t *leaves = stage->tree + qt->offset[level+1];
+	int *edge, *last = qt->edge[level] + 2 * qt->edges[level];
+	int child = first_child(qt, level, begin, &edge);
+	for (int block = begin; block < end;) {
+		int stop = block + BLOCK < end ? block + BLOCK : end;
+		int *next_edge = edge, next = child + 4 * (stop - block);
+		for (; next_edge < last && *next_edge < stop; next_edge += 2)
+			next -= 4 - next_edge[1];
+		for (int chan = 0; chan < 3; ++chan)
+			restore_nodes(node + chan * size, leaves + chan * size + child, edge, last, block, stop);
+		emit(stage->output, leaves, leaves + size, leaves + 2 * size, qt->leaf, stage->mode, child, next);
+		block = stop;
+		child = next;
+		edge = next_edge;
+	}
+}
+
+static void reconstruct(struct tile *tile, uint8_t *output)
+{
+	struct quadtree *qt = tile->thumb;
+	struct stage stage = { tile->tree, tile->flags, tile->tree_size, tile->words, output, qt, 0, tile->mode };
+	if (tile->tree) {
+		long long start = timer_now();
+		pool_split(process_worker, &stage, 3, qt->total-1);
+		start = timer_stage(tile->nanos, STAGE_PROCESS, start);
+		for (stage.level = 0; stage.level < qt->depth-1; ++stage.level)
+			pool_split(doit_worker, &stage, 3, qt->size[stage.level]);
+		start = timer_stage(tile->nanos, STAGE_DOIT, start);
+		if (qt->depth)
+			pool_split(emit_worker, &stage, 1, qt->size[qt->depth-1]);
+		else
+			emit(output, stage.tree, stage.tree + stage.tree_size, stage.tree + 2 * (size_t)stage.tree_size, qt->leaf, tile->mode, 0, 1);
+		timer_stage(tile->nanos, STAGE_COPY, start);
+	}
+	arena_free(ARENA_TREE, tile->tree);
+	arena_free(ARENA_FLAGS, tile->flags);
+	put_quadtree(tile->qt);
+	put_quadtree(qt);
+}
+
+struct tiles {
+	const char *name;
+	uint8_t *pixels;
+	int pitch;
+	int width;
+	int height;
+	int size;
+	int cols;
+	int shrink;
+	int mode;
+	const uint8_t *data;
+	size_t *offsets;
+	size_t *sizes;
+	long long *nanos;
+	int error;
+};
+
+static void decode_worker(void *arg, int job)
+{
+	struct tiles *tiles = arg;
+	int x = job % tiles->cols * tiles->size;
+	int y = job / tiles->cols * tiles->size;
+	int width = tiles->width - x < tiles->size ? tiles->width - x : tiles->size;
+	int height = tiles->height - y < tiles->size ? tiles->height - y : tiles->size;
+	struct tile tile;
+	init_tile(&tile, width, height, tiles->pitch, tiles->shrink, tiles->mode, tiles->nanos);
+	struct bits_reader *bits = bits_reader_memory(tiles->data + tiles->offsets[job], tiles->sizes[job], tiles->name);
+	struct vli_reader *vli = vli_reader(bits);
+	if (decode_tile(vli, &tile))
+		tiles->error = 1;
+	delete_vli_reader(vli);
+	close_reader(bits);
+	x >>= tiles->shrink;
+	y >>= tiles->shrink;
+	reconstruct(&tile, tiles->pixels+3*((size_t)tiles->pitch*y+x));
+}
+
+int lqt_decode(struct lqt *lqt, const uint8_t *input, size_t input_size, int shrink, long long budget, const uint8_t **pixels, int *output_width, int *output_height)
+{
+	struct arena *outer = arena_bind(&lqt->arena);
+	struct pool *outer_pool = pool_bind(&lqt->pool);
+	for (int stage = 0; stage < STAGES; ++stage)
+		lqt->stats.nanos[stage] = 0;
+	struct bits_reader *bits = bits_reader_memory(input, input_size, lqt->name);
+	struct vli_reader *vli = vli_reader(bits);
+	int mode = get_vli(vli);
+	int width = get_vli(vli);
+	int height = get_vli(vli);
+	int tile_log = get_vli(vli);
+	if ((mode|tile_log|shrink) < 0 || width < 1 || height < 1 || mode & ~31 || tile_log > 30)
+		goto fail;
+	if (!tile_log && budget >= 0) {
+		if ((budget + 7) / 8 < budget_head(input, input_size, 4)) {
+			fprintf(stderr, "budget of %lld bits too small for the roots and planes.\n", budget);
+			goto fail;
+		}
+		limit_reader(bits, (budget + 7) / 8);
+	}
+	int limit = tile_log ? tile_log : quadtree_depth(width, height);
+	if (shrink > limit)
+		shrink = limit;
+	int thumb_width = (width + (1LL << shrink) - 1) >> shrink;
+	int thumb_height = (height + (1LL << shrink) - 1) >> shrink;
+	int tile_width = tile_log && 1 << tile_log < width ? 1 << tile_log : width;
+	int tile_height = tile_log && 1 << tile_log < height ? 1 << tile_log : height;
+	long long count = (long long)((width + tile_width - 1) / tile_width) * ((height + tile_height - 1) / tile_height);
+	if (count > INT_MAX || !quadtree_fits(tile_width, tile_height, thumb_width)) {
+		fprintf(stderr, "picture of %dx%d pixels needs tiles smaller than %dx%d pixels.\n", width, height, tile_width, tile_height);
+		goto fail;
+	}
+	size_t size = 3 * (size_t)thumb_width * thumb_height;
+	if (lqt->pixels_size < size) {
+		free(lqt->pixels);
+		lqt->pixels = malloc(size);
+		lqt->pixels_size = size;
+	}
+	if (!tile_log) {
+		struct tile tile;
+		init_tile(&tile, width, height, thumb_width, shrink, mode, lqt->stats.nanos);
+		int error = decode_tile(vli, &tile);
+		reconstruct(&tile, lqt->pixels);
+		if (error)
+			goto fail;
+	} else {
+		int tile_size = 1 << tile_log;
+		int cols = (width + tile_size - 1) / tile_size;
+		int rows = (height + tile_size - 1) / tile_size;
+		int num = cols * rows;
+		size_t *offsets = malloc(sizeof(size_t) * (num + 1));
+		size_t *sizes = malloc(sizeof(size_t) * num);
+		int error = 1;
+		offsets[0] = 0;
+		for (int i = 0; i < num; ++i) {
+			long long bytes = get_vli_long(vli);
+			if (bytes < 0)
+				goto end;
+			offsets[i+1] = offsets[i] + bytes;
+		}
+		align_reader(bits);
+		for (int i = 0; i < num; ++i)
+			sizes[i] = offsets[i+1] - offsets[i];
+		long long header = bits_offset(bits);
+		const uint8_t *data = map_bytes(bits, offsets[num]);
+		if (!data)
+			goto end;
+		if (budget >= 0 && budget_tiles(data, sizes, num, (budget + 7) / 8 - header)) {
+			fprintf(stderr, "budget of %lld bits too small for %d tiles.\n", budget, num);
+			goto end;
+		}
+		struct tiles tiles = { lqt->name, lqt->pixels, thumb_width, width, height, tile_size, cols, shrink, mode, data, offsets, sizes, lqt->stats.nanos, 0 };
+		pool_run(decode_worker, &tiles, num);
+		error = tiles.error;
+end:
+		free(offsets);
+		free(sizes);
+		if (error)
+			goto fail;
+	}
+	delete_vli_reader(vli);
+	close_reader(bits);
+	arena_bind(outer);
+	pool_bind(outer_pool);
+	*pixels = lqt->pixels;
+	*output_width = thumb_width;
+	*output_height = thumb_height;
+	return 0;
+fail:
+	delete_vli_reader(vli);
+	close_reader(bits);
+	arena_bind(outer);
+	pool_bind(outer_pool);
+	return 1;
+}
@@ -0,0 +1,992 @@
+/*
+Encoder for lossless image compression based on the quadtree data structure
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#include "lqt.h"
+#include "context.h"
+#include "rle.h"
+#include "rac.h"
+#include "vli.h"
+#include "bits.h"
+#include "quadtree.h"
+#include "pyramid.h"
+#include "pool.h"
+#include "stats.h"
+
+static void doit(int16_t *tree, struct quadtree *qt, int level, int begin, int end)
+{
+	int16_t *node = tree + qt->offset[level];
+	int *edge, *last = qt->edge[level] + 2 * qt->edges[level];
+	int16_t *child = tree + qt->offset[level+1] + first_child(qt, level, begin, &edge);
+	for (int i = begin; i < end; ++i) {
+		int next = edge < last && *edge < end ? *edge : end;
+		average(node+i, child, next-i);
+		child += 4 * (next-i);
+		i = next;
+		if (i == end)
+			break;
+		int cnt = edge[1];
+		edge += 2;
+		int sum = 0;
+		for (int k = 0; k < cnt; ++k)
+			sum += child[k];
+		if (sum < 0)
+			sum -= cnt / 2;
+		else
+			sum += cnt / 2;
+		int avg = sum / cnt;
+		node[i] = avg;
+		for (int k = 0; k < cnt; ++k)
+			child[k] -= avg;
+		child += cnt;
+	}
+}
+
+/*
+copy() takes the samples of a channel from the bytes of the pixels,
+with the color transform and centered around zero.
+*/
+
+static void copy(int16_t *output, const uint8_t *input, int *leaf, int chan, int mode, int begin, int end)
+{
+	if (!(mode & 1)) {
+		for (int i = begin; i < end; ++i)
+			output[i] = input[3*(size_t)leaf[i]+chan] - 128;
+		return;
+	}
+	for (int i = begin; i < end; ++i) {
+		const uint8_t *pixel = input + 3 * (size_t)leaf[i];
+		int R = pixel[0], G = pixel[1], B = pixel[2];
+		if (chan == 0)
+			output[i] = (R + 2*G + B) / 4 - 128;
+		else if (chan == 1)
+			output[i] = R - G;
+		else
+			output[i] = B - G;
+	}
+}
+
+/*
+The coefficients are magnitudes, the signs and the "significant" and
+"refine" flags are kept in bitmaps with one bit for each coefficient.
+The passes only visit the coefficients they code, skipping 64 at once,
+and "count" keeps track of the refined coefficients of each level, so
+that passes with nothing to code are skipped completely.
+*/
+
+struct coefs {
+	int16_t *val;
+	uint64_t *sgn;
+	uint64_t *sig;
+	uint64_t *ref;
+	uint64_t *zt[2];
+	uint64_t *busy;
+	uint8_t *desc;
+	uint16_t *prob;
+	int *count;
+};
+
+static uint64_t word_mask(int first, int last, int w)
+{
+	uint64_t mask = ~(uint64_t)0;
+	if (w == first / 64)
+		mask &= ~(uint64_t)0 << (first % 64);
+	if (w == last / 64)
+		mask &= ~(uint64_t)0 >> (63 - last % 64);
+	return mask;
+}
+
+static int refinement(struct rle_writer *rle, struct coefs *c, int first, int num, int plane, int *count, int fresh)
+{
+	int last = first + num - 1;
+	for (int w = first / 64; (*count || fresh) && w <= last / 64; ++w) {
+		uint64_t mask = word_mask(first, last, w);
+		for (uint64_t todo = *count ? mask & c->ref[w] : 0; todo; todo &= todo - 1) {
+			int b = __builtin_ctzll(todo);
+			int ret = rle_put_bit(rle, (c->val[64*w+b] >> plane) & 1);
+			if (ret)
+				return ret;
+		}
+		c->ref[w] |= c->sig[w] & mask;
+		c->sig[w] &= ~mask;
+	}
+	*count += fresh;
+	return 0;
+}
+
+static int signify(struct rle_writer *rle, struct coefs *c, int i)
+{
+	int ret = rle_put_bit(rle, (c->sgn[i/64] >> (i%64)) & 1);
+	if (ret)
+		return ret;
+	c->sig[i/64] |= (uint64_t)1 << (i%64);
+	return 1;
+}
+
+static int significant(struct rle_writer *rle, struct coefs *c, int i, int plane)
+{
+	int bit = (c->val[i] >> plane) & 1;
+	int ret = put_rle(rle, bit);
+	if (ret)
+		return ret;
+	if (bit)
+		return signify(rle, c, i);
+	return 0;
+}
+
+static uint64_t plane_bits(int16_t *val, uint64_t todo, int plane)
+{
+	uint64_t bits = 0;
+	for (; todo; todo &= todo - 1) {
+		int b = __builtin_ctzll(todo);
+		bits |= (uint64_t)((val[b] >> plane) & 1) << b;
+	}
+	return bits;
+}
+
+/*
+The significance pass hands over a word of coefficients at once,
+so that runs of zeros are counted and not coded one by one.
+*/
+
+static int encode(struct rle_writer *rle, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	int first = qt->offset[layer+1], num = qt->size[layer+1];
+	int *count = c->count + layer;
+	int last = first + num - 1;
+	int fresh = 0;
+	for (int w = first / 64; *count < num && w <= last / 64; ++w) {
+		uint64_t todo = word_mask(first, last, w) & ~c->ref[w];
+		uint64_t bits = plane_bits(c->val + 64 * w, todo, plane);
+		while (1) {
+			int b = rle_put_mask(rle, &todo, bits);
+			if (b < 0)
+				return b;
+			if (b == 64)
+				break;
+			int ret = signify(rle, c, 64 * w + b);
+			if (ret < 0)
+				return ret;
+			++fresh;
+		}
+	}
+	return refinement(rle, c, first, num, plane, count, fresh);
+}
+
+/*
+In the zero tree mode, the significance pass of a coefficient is
+followed by a bit telling if any of its descendants is significant at
+this plane. If none is, the descendants are known to be zero at this
+plane and are skipped, when their levels get to code this plane.
+Once a descendant is significant, it stays so for the lower planes
+and the bit is not needed anymore, which is what "busy" remembers.
+Coefficients with only children or grandchildren are not worth the bit.
+The flags for the even and odd planes are kept apart, as a level codes
+the next plane before its children get to code this one.
+*/
+
+static int encode_zerotree(struct rle_writer *rle, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	int first = qt->offset[layer+1], num = qt->size[layer+1];
+	int *count = c->count + layer;
+	uint64_t *zt = c->zt[plane&1];
+	int *edge = qt->edge[layer], *last = edge + 2 * qt->edges[layer];
+	int small = layer+2 >= qt->depth;
+	int fresh = 0;
+	for (int i = 0, child = first; i < qt->size[layer]; ++i) {
+		int cnt = 4;
+		if (edge < last && *edge == i) {
+			cnt = edge[1];
+			edge += 2;
+		}
+		int parent = qt->offset[layer] + i;
+		int skip = layer && (zt[parent/64] >> (parent%64)) & 1;
+		for (int end = child + cnt; child < end; ++child) {
+			uint64_t bit = (uint64_t)1 << (child%64);
+			if (skip) {
+				zt[child/64] |= bit;
+				continue;
+			}
+			zt[child/64] &= ~bit;
+			if (!(c->ref[child/64] & bit)) {
+				int ret = significant(rle, c, child, plane);
+				if (ret < 0)
+					return ret;
+				fresh += ret;
+			}
+			if (small || c->busy[child/64] & bit)
+				continue;
+			int busy = c->desc[child] > plane;
+			int ret = put_rle(rle, busy);
+			if (ret)
+				return ret;
+			if (busy)
+				c->busy[child/64] |= bit;
+			else
+				zt[child/64] |= bit;
+		}
+	}
+	return refinement(rle, c, first, num, plane, count, fresh);
+}
+
+/*
+In the arithmetic coding mode, all bits of the passes are coded with
+adaptive probabilities, which are kept apart for each channel and level.
+Significance bits are told apart by the significance of the parent and of
+the preceding coefficient, which is a neighbour in the Hilbert order.
+Signs are told apart by the sign of a significant preceding coefficient
+and refinement bits by being the first refinement of a coefficient.
+*/
+
+enum { CTX_SIG = 0, CTX_SGN = 4, CTX_REF = 7, CTX_BUSY = 9, CONTEXTS = 11 };
+
+static int flag(uint64_t *map, int i)
+{
+	return (map[i/64] >> (i%64)) & 1;
+}
+
+static int refinement_arith(struct rac_writer *rac, struct coefs *c, uint16_t *prob, int first, int num, int plane, int *count, int fresh)
+{
+	int last = first + num - 1;
+	for (int w = first / 64; (*count || fresh) && w <= last / 64; ++w) {
+		uint64_t mask = word_mask(first, last, w);
+		for (uint64_t todo = *count ? mask & c->ref[w] : 0; todo; todo &= todo - 1) {
+			int i = 64 * w + __builtin_ctzll(todo);
+			int ret = put_rac(rac, prob + CTX_REF + (c->val[i] >> (plane+1) == 1), (c->val[i] >> plane) & 1);
+			if (ret)
+				return ret;
+		}
+		c->ref[w] |= c->sig[w] & mask;
+		c->sig[w] &= ~mask;
+	}
+	*count += fresh;
+	return 0;
+}
+
+static int significant_arith(struct rac_writer *rac, struct coefs *c, uint16_t *prob, int i, int plane, int above, int left)
+{
+	int bit = (c->val[i] >> plane) & 1;
+	int ret = put_rac(rac, prob + CTX_SIG + 2 * above + left, bit);
+	if (ret)
+		return ret;
+	if (bit) {
+		int ctx = left ? 1 + flag(c->sgn, i-1) : 0;
+		int ret = put_rac(rac, prob + CTX_SGN + ctx, flag(c->sgn, i));
+		if (ret)
+			return ret;
+		c->sig[i/64] |= (uint64_t)1 << (i%64);
+	}
+	return bit;
+}
+
+static int encode_arith(struct rac_writer *rac, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	int first = qt->offset[layer+1], num = qt->size[layer+1];
+	int *count = c->count + layer;
+	uint64_t *zt = c->busy ? c->zt[plane&1] : 0;
+	int *edge = qt->edge[layer], *last = edge + 2 * qt->edges[layer];
+	int small = !zt || layer+2 >= qt->depth;
+	uint16_t *prob = c->prob + CONTEXTS * (layer+1);
+	int fresh = 0;
+	for (int i = 0, child = first; i < qt->size[layer] && (zt || *count < num); ++i) {
+		int cnt = 4;
+		if (edge < last && *edge == i) {
+			cnt = edge[1];
+			edge += 2;
+		}
+		int parent = qt->offset[layer] + i;
+		int skip = zt && layer && flag(zt, parent);
+		int above = flag(c->ref, parent) | flag(c->sig, parent);
+		for (int end = child + cnt; child < end; ++child) {
+			uint64_t bit = (uint64_t)1 << (child%64);
+			if (skip) {
+				zt[child/64] |= bit;
+				continue;
+			}
+			if (zt)
+				zt[child/64] &= ~bit;
+			if (!(c->ref[child/64] & bit)) {
+				int left = child > first && (flag(c->ref, child-1) | flag(c->sig, child-1));
+				int ret = significant_arith(rac, c, prob, child, plane, above, left);
+				if (ret < 0)
+					return ret;
+				fresh += ret;
+			}
+			if (small || c->busy[child/64] & bit)
+				continue;
+			int busy = c->desc[child] > plane;
+			int ret = put_rac(rac, prob + CTX_BUSY + !!(c->ref[child/64] & bit) + !!(c->sig[child/64] & bit), busy);
+			if (ret)
+				return ret;
+			if (busy)
+				c->busy[child/64] |= bit;
+			else
+				zt[child/64] |= bit;
+		}
+	}
+	return refinement_arith(rac, c, prob, first, num, plane, count, fresh);
+}
+
+static int code(struct rle_writer *rle, struct rac_writer *rac, struct coefs *c, struct quadtree *qt, int layer, int plane)
+{
+	if (rac)
+		return encode_arith(rac, c, qt, layer, plane);
+	if (c->busy)
+		return encode_zerotree(rle, c, qt, layer, plane);
+	return encode(rle, c, qt, layer, plane);
+}
+
+static void encode_root(struct vli_writer *vli, int16_t *root)
+{
+	put_vli(vli, abs(*root));
+	if (*root)
+		vli_put_bit(vli, *root < 0);
+}
+
+static int ilog2(int x)
+{
+	int l = -1;
+	for (; x > 0; x /= 2)
+		++l;
+	return l;
+}
+
+static int process(int16_t *val, uint64_t *sgn, int begin, int end)
+{
+	int max = 0;
+	for (int i = begin; i < end; ++i) {
+		if (val[i] < 0)
+			sgn[i/64] |= (uint64_t)1 << (i%64);
+		else
+			sgn[i/64] &= ~((uint64_t)1 << (i%64));
+		val[i] = abs(val[i]);
+		if (max < val[i])
+			max = val[i];
+	}
+	return max;
+}
+
+/*
+desc[i] is the number of planes needed by the largest descendant of i.
+*/
+
+static void descend(int16_t *val, uint8_t *desc, struct quadtree *qt, int level, int begin, int end)
+{
+	int *edge, *last = qt->edge[level] + 2 * qt->edges[level];
+	int child = qt->offset[level+1] + first_child(qt, level, begin, &edge);
+	for (int i = qt->offset[level] + begin; i < qt->offset[level] + end; ++i) {
+		int cnt = 4;
+		if (edge < last && *edge == i - qt->offset[level]) {
+			cnt = edge[1];
+			edge += 2;
+		}
+		int max = 0;
+		for (int end = child + cnt; child < end; ++child) {
+			int planes = val[child] ? 32 - __builtin_clz(val[child]) : 0;
+			if (max < planes)
+				max = planes;
+			if (max < desc[child])
+				max = desc[child];
+		}
+		desc[i] = max;
+	}
+}
+
+struct stage {
+	int16_t *tree;
+	uint8_t *desc;
+	uint64_t *sgn;
+	const uint8_t *input;
+	struct quadtree *qt;
+	int words;
+	int level;
+	int mode;
+	int max[3];
+	pthread_mutex_t lock;
+};
+
+static void copy_worker(void *arg, int chan, int begin, int end)
+{
+	struct stage *stage = arg;
+	struct quadtree *qt = stage->qt;
+	copy(stage->tree+(size_t)chan*qt->total+qt->offset[qt->depth], stage->input, qt->leaf, chan, stage->mode, begin, end);
+}
+
+static void doit_worker(void *arg, int chan, int begin, int end)
+{
+	struct stage *stage = arg;
+	doit(stage->tree+(size_t)chan*stage->qt->total, stage->qt, stage->level, begin, end);
+}
+
+static void descend_worker(void *arg, int chan, int begin, int end)
+{
+	struct stage *stage = arg;
+	int total = stage->qt->total;
+	descend(stage->tree+(size_t)chan*total, stage->desc+(size_t)chan*total, stage->qt, stage->level, begin, end);
+}
+
+static void process_worker(void *arg, int chan, int begin, int end)
+{
+	struct stage *stage = arg;
+	int total = stage->qt->total;
+	begin = begin ? 64 * begin : 1;
+	end = 64LL * end < total ? 64 * end : total;
+	int max = process(stage->tree+(size_t)chan*total, stage->sgn+chan*stage->words, begin, end);
+	pthread_mutex_lock(&stage->lock);
+	if (stage->max[chan] < max)
+		stage->max[chan] = max;
+	pthread_mutex_unlock(&stage->lock);
+}
+
+struct tile {
+	int16_t *tree;
+	uint8_t *desc;
+	uint64_t *flags;
+	int words;
+	struct quadtree *qt;
+	int planes[3];
+	int mode;
+	struct stats *stats;
+};
+
+static void transform(struct tile *tile, const uint8_t *input, int width, int height, int pitch, int mode, struct stats *stats)
+{
+	long long *nanos = stats->nanos;
+	long long start = timer_now();
+	int zerotree = mode & 2;
+	struct quadtree *qt = get_quadtree(width, height, pitch);
+	int16_t *tree = arena_malloc(ARENA_TREE, sizeof(int16_t) * 3 * qt->total);
+	uint8_t *desc = zerotree ? arena_calloc(ARENA_DESC, 3 * (size_t)qt->total, sizeof(uint8_t)) : 0;
+	int words = (qt->total + 63) / 64;
+	uint64_t *flags = arena_calloc(ARENA_FLAGS, (zerotree ? 6 : 3) * 3 * words, sizeof(uint64_t));
+	struct stage stage = { tree, desc, flags, input, qt, words, 0, mode, { 0 }, PTHREAD_MUTEX_INITIALIZER };
+	pool_split(copy_worker, &stage, 3, qt->size[qt->depth]);
+	start = timer_stage(nanos, STAGE_COPY, start);
+	for (stage.level = qt->depth-1; stage.level >= 0; --stage.level)
+		pool_split(doit_worker, &stage, 3, qt->size[stage.level]);
+	start = timer_stage(nanos, STAGE_DOIT, start);
+	pool_split(process_worker, &stage, 3, words);
+	start = timer_stage(nanos, STAGE_PROCESS, start);
+	for (stage.level = qt->depth-1; zerotree && stage.level >= 0; --stage.level)
+		pool_split(descend_worker, &stage, 3, qt->size[stage.level]);
+	timer_stage(nanos, STAGE_DESCEND, start);
+	for (int chan = 0; chan < 3; ++chan)
+		tile->planes[chan] = 1 + ilog2(stage.max[chan]);
+	tile->tree = tree;
+	tile->desc = desc;
+	tile->flags = flags;
+	tile->words = words;
+	tile->qt = qt;
+	tile->mode = mode;
+	tile->stats = stats;
+}
+
+static void delete_tile(struct tile *tile)
+{
+	arena_free(ARENA_TREE, tile->tree);
+	arena_free(ARENA_DESC, tile->desc);
+	arena_free(ARENA_FLAGS, tile->flags);
+	put_quadtree(tile->qt);
+}
+
+/*
+pass() codes a plane of a level of a channel and counts what it wrote.
+The refinement bits are those of the coefficients significant before and
+the sign bits those of the coefficients that became significant.
+*/
+
+static long long position(struct rle_writer *rle, struct rac_writer *rac)
+{
+	return rac ? 8LL * rac->count : bits_count(rle->vli->bits);
+}
+
+static int pass(struct rle_writer *rle, struct rac_writer *rac, struct coefs *c, struct tile *tile, struct stats *stats, int chan, int layer, int plane)
+{
+	long long begin = position(rle, rac);
+	int refined = c->count[layer];
+	int ret = code(rle, rac, c, tile->qt, layer, plane);
+	stats_add(&stats->bits[chan][layer+1][plane], position(rle, rac) - begin);
+	stats_add(&stats->signs[chan][layer+1][plane], c->count[layer] - refined);
+	stats_add(&stats->refinements[chan][layer+1][plane], refined);
+	return ret;
+}
+
+/*
+code_layers() codes the passes of the channels from "first" to "last"
+that belong to the given layers, level by level.
+*/
+
+static int code_layers(struct rle_writer *rle, struct rac_writer *rac, struct coefs *coefs, struct tile *tile, struct stats *stats, int first, int last, int layers, int planes_max)
+{
+	for (int layer = 0; layer < tile->qt->depth && layer <= layers; ++layer) {
+		for (int chan = first; chan < last; ++chan) {
+			int plane = planes_max-1 - (layers-layer);
+			if (plane < 0 || plane >= tile->planes[chan])
+				continue;
+			if (pass(rle, rac, coefs+chan, tile, stats, chan, layer, plane))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static void open_coder(struct vli_writer *vli, int mode, struct rle_writer **rle, struct rac_writer **rac)
+{
+	*rle = 0;
+	*rac = 0;
+	if (mode & 4)
+		*rac = rac_writer(vli->bits);
+	else
+		*rle = rle_writer(vli);
+}
+
+static void close_coder(struct rle_writer *rle, struct rac_writer *rac, int done, struct stats *stats)
+{
+	if (rac) {
+		rac_flush(rac);
+		delete_rac_writer(rac);
+		return;
+	}
+	if (done)
+		rle_flush(rle);
+	for (int i = 0; i < STATS_RUNS; ++i)
+		if (rle->runs[i])
+			stats_add(&stats->runs[i], rle->runs[i]);
+	delete_rle_writer(rle);
+}
+
+/*
+With mode 8 every channel is coded into a substream of its own, so the
+three channels are coded in parallel. Each substream is cut into chunks
+at the end of each layer and the chunks follow a table of their lengths
+layer by layer, Y before U before V, as the passes of the single stream
+do. Every chunk is coded on its own: the run of zeros left at its end
+is flushed, the range coder is finished and the chunk ends on a byte,
+so the chunks of the first layers decode without those that follow.
+Chunks of layers without any passes of their channels stay empty.
+A prefix of the tile still holds the first layers of all channels and
+a limited capacity simply keeps such a prefix. The substreams are coded
+a layer at a time, and the chunks of a layer may only take the room the
+chunks before them left, so the coding stops at the layer that does not
+fit. Each substream counts its passes on its own, and only what was
+written of its chunks is added to the statistics of the tile.
+Mode 16 cuts the single stream into chunks the same way, so that the
+table is an index of the layers, which lqt_truncate() cuts at without
+decoding. The table of mode 8 already is such an index.
+*/
+
+struct substreams {
+	const char *name;
+	struct tile *tile;
+	struct coefs *coefs;
+	int streams;
+	int planes_max;
+	int layers;
+	long long room;
+	struct bits_writer *bits[3];
+	struct stats *stats[3];
+	int failed[3];
+};
+
+static int has_passes(struct substreams *sub, int stream, int layers)
+{
+	int first = sub->streams > 1 ? stream : 0, last = sub->streams > 1 ? stream+1 : 3;
+	for (int layer = 0; layer < sub->tile->qt->depth && layer <= layers; ++layer) {
+		for (int chan = first; chan < last; ++chan) {
+			int plane = sub->planes_max-1 - (layers-layer);
+			if (plane >= 0 && plane < sub->tile->planes[chan])
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static int code_substream(struct rle_writer *rle, struct rac_writer *rac, struct substreams *sub, int stream, int layers)
+{
+	struct stats *stats = sub->stats[stream];
+	if (sub->streams > 1)
+		return code_layers(rle, rac, sub->coefs, sub->tile, stats, stream, stream+1, layers, sub->planes_max);
+	return code_layers(rle, rac, sub->coefs, sub->tile, stats, 0, 1, layers, sub->planes_max) || code_layers(rle, rac, sub->coefs, sub->tile, stats, 1, 3, layers, sub->planes_max);
+}
+
+/*
+add_chunk() adds the passes of a chunk to the statistics of the tile, as
+far as its first "left" bits hold them, in the order they were coded. A
+plane of a level belongs to a single layer, so the passes of a chunk are
+found among those of its substream, whose runs are counted anew with
+each layer and only added for chunks kept whole.
+*/
+
+static void add_chunk(struct substreams *sub, int stream, int layers, long long left)
+{
+	struct stats *stats = sub->tile->stats, *chunk = sub->stats[stream];
+	int groups = sub->streams > 1 ? 1 : 2;
+	for (int group = 0; group < groups; ++group) {
+		int first = sub->streams > 1 ? stream : group, last = sub->streams > 1 ? stream+1 : group ? 3 : 1;
+		for (int layer = 0; layer < sub->tile->qt->depth && layer <= layers; ++layer) {
+			for (int chan = first; chan < last; ++chan) {
+				int plane = sub->planes_max-1 - (layers-layer);
+				if (plane < 0 || plane >= sub->tile->planes[chan])
+					continue;
+				long long bits = chunk->bits[chan][layer+1][plane];
+				if (bits > left) {
+					stats_add(&stats->bits[chan][layer+1][plane], left);
+					return;
+				}
+				left -= bits;
+				stats_add(&stats->bits[chan][layer+1][plane], bits);
+				stats_add(&stats->signs[chan][layer+1][plane], chunk->signs[chan][layer+1][plane]);
+				stats_add(&stats->refinements[chan][layer+1][plane], chunk->refinements[chan][layer+1][plane]);
+			}
+		}
+	}
+	for (int i = 0; i < STATS_RUNS; ++i)
+		if (chunk->runs[i])
+			stats_add(&stats->runs[i], chunk->runs[i]);
+}
+
+static void substream_worker(void *arg, int stream)
+{
+	struct substreams *sub = arg;
+	struct bits_writer *bits = sub->bits[stream];
+	memset(sub->stats[stream]->runs, 0, sizeof(sub->stats[stream]->runs));
+	sub->failed[stream] = 0;
+	if (!has_passes(sub, stream, sub->layers))
+		return;
+	if (!sub->room) {
+		sub->failed[stream] = 1;
+		return;
+	}
+	bits->cap = sub->room < 0 ? 0 : bits_count(bits) + 8 * sub->room;
+	struct vli_writer *vli = vli_writer(bits);
+	struct rle_writer *rle;
+	struct rac_writer *rac;
+	open_coder(vli, sub->tile->mode, &rle, &rac);
+	int ret = code_substream(rle, rac, sub, stream, sub->layers);
+	if (!ret && rle && rle->cnt > 0)
+		ret = rle_flush(rle);
+	close_coder(rle, rac, 0, sub->stats[stream]);
+	sub->failed[stream] = align_writer(bits) || ret;
+	delete_vli_writer(vli);
+}
+
+static int encode_substreams(struct vli_writer *vli, struct tile *tile, struct coefs *coefs, int layers_max, int planes_max)
+{
+	if (layers_max < 1)
+		return layers_max;
+	struct bits_writer *bits = vli->bits;
+	int streams = tile->mode & 8 ? 3 : 1, num = streams * layers_max;
+	struct substreams sub = { bits->name, tile, coefs, streams, planes_max, 0, -1, { 0 }, { 0 }, { 0 } };
+	for (int stream = 0; stream < streams; ++stream) {
+		sub.bits[stream] = bits_writer_memory(0, bits->name);
+		sub.stats[stream] = calloc(1, sizeof(struct stats));
+	}
+	size_t *first = calloc(2 * num, sizeof(size_t)), *length = first + num, ends[3] = { 0 };
+	long long table = num, kept = 0;
+	int cut;
+	for (cut = 0; cut < layers_max; ++cut) {
+		if (bits->cap > 0) {
+			sub.room = (bits->cap - bits_count(bits) - table - 7) / 8 - kept;
+			if (sub.room < 0)
+				sub.room = 0;
+		}
+		sub.layers = cut;
+		pool_run(substream_worker, &sub, streams);
+		long long grown = table, bytes = 0;
+		int whole = 1;
+		for (int stream = 0; stream < streams; ++stream) {
+			int i = cut * streams + stream;
+			first[i] = ends[stream];
+			ends[stream] = bits_count(sub.bits[stream]) / 8;
+			length[i] = ends[stream] - first[i];
+			grown += vli_bits(length[i]) - 1;
+			bytes += length[i];
+			whole &= !sub.failed[stream];
+		}
+		long long room = bits->cap > 0 ? (bits->cap - bits_count(bits) - grown - 7) / 8 - kept : LLONG_MAX;
+		if (whole && bytes <= room) {
+			for (int stream = 0; stream < streams; ++stream)
+				add_chunk(&sub, stream, cut, LLONG_MAX);
+			table = grown;
+			kept += bytes;
+			continue;
+		}
+		if (room < 0)
+			room = 0;
+		for (int stream = 0; stream < streams; ++stream) {
+			size_t *len = length + cut * streams + stream;
+			if ((long long)*len > room)
+				*len = room;
+			add_chunk(&sub, stream, cut, 8 * (long long)*len);
+			room -= *len;
+		}
+		break;
+	}
+	for (int i = 0; i < num; ++i)
+		put_vli_long(vli, length[i]);
+	align_writer(bits);
+	uint8_t *data[3];
+	for (int stream = 0; stream < streams; ++stream) {
+		size_t size;
+		data[stream] = release_writer(sub.bits[stream], &size);
+		free(sub.stats[stream]);
+	}
+	for (int i = 0; i < num; ++i)
+		write_bytes(bits, data[i%streams] + first[i], length[i]);
+	for (int stream = 0; stream < streams; ++stream)
+		free(data[stream]);
+	free(first);
+	return cut;
+}
+
+static void encode_tile(struct vli_writer *vli, struct tile *tile)
+{
+	long long start = timer_now();
+	int16_t *tree = tile->tree;
+	int *planes = tile->planes;
+	int tree_size = tile->qt->total;
+	int depth = tile->qt->depth;
+	int words = tile->words;
+	for (int chan = 0; chan < 3; ++chan)
+		encode_root(vli, tree+(size_t)chan*tree_size);
+	for (int chan = 0; chan < 3; ++chan)
+		put_vli(vli, planes[chan]);
+	uint16_t *prob = 0;
+	if (tile->mode & 4) {
+		prob = malloc(sizeof(uint16_t) * 3 * (depth + 1) * CONTEXTS);
+		rac_probs(prob, 3 * (depth + 1) * CONTEXTS);
+	}
+	int *count = calloc(3 * depth + 1, sizeof(int));
+	struct coefs coefs[3];
+	for (int chan = 0; chan < 3; ++chan) {
+		struct coefs *c = coefs + chan;
+		c->val = tree + (size_t)chan * tree_size;
+		c->sgn = tile->flags + chan * words;
+		c->sig = c->sgn + 3 * words;
+		c->ref = c->sig + 3 * words;
+		c->zt[0] = c->zt[1] = c->busy = 0;
+		c->desc = 0;
+		if (tile->mode & 2) {
+			c->zt[0] = c->ref + 3 * words;
+			c->zt[1] = c->zt[0] + 3 * words;
+			c->busy = c->zt[1] + 3 * words;
+			c->desc = tile->desc + (size_t)chan * tree_size;
+		}
+		c->prob = prob ? prob + chan * (depth + 1) * CONTEXTS : 0;
+		c->count = count + chan * depth;
+	}
+	int planes_max = 0;
+	for (int chan = 0; chan < 3; ++chan)
+		if (planes_max < planes[chan])
+			planes_max = planes[chan];
+	int maximum = depth > planes_max ? depth : planes_max;
+	int layers_max = 2 * maximum - 1, layers;
+	if (tile->mode & 24) {
+		layers = encode_substreams(vli, tile, coefs, layers_max, planes_max);
+	} else {
+		struct rle_writer *rle;
+		struct rac_writer *rac;
+		open_coder(vli, tile->mode, &rle, &rac);
+		for (layers = 0; layers < layers_max; ++layers)
+			if (code_layers(rle, rac, coefs, tile, tile->stats, 0, 1, layers, planes_max) || code_layers(rle, rac, coefs, tile, tile->stats, 1, 3, layers, planes_max))
+				break;
+		close_coder(rle, rac, layers == layers_max, tile->stats);
+	}
+	if (layers < layers_max)
+		stats_add(&tile->stats->cuts[layers], 1);
+	free(prob);
+	free(count);
+	timer_stage(tile->stats->nanos, STAGE_CODE, start);
+}
+
+/*
+Pictures are taken a few rows of tiles at a time, from the pixels given
+to lqt_encode() or read by the reader of lqt_encode_rows(). Then only
+these rows and the tiles being encoded are in memory, no matter how high
+the picture is. Enough rows of tiles are taken to keep all threads busy.
+The streams of their tiles are appended to the output right away, and
+the header with the table of the sizes of the tiles is put in front of
+them at the end, so the stream is held only once, but it is held whole
+and grows with the picture until it is returned. With a capacity, the
+tiles are coded whole and the stream is cut by lqt_truncate(), which
+shares it among the tiles by their sizes, as only then they are known.
+*/
+
+struct source {
+	const uint8_t *pixels;
+	int (*read)(void *, uint8_t *, int);
+	void *arg;
+	int width;
+	int row;
+};
+
+static const uint8_t *source_rows(struct source *source, uint8_t *buffer, int num, long long *nanos)
+{
+	const uint8_t *pixels = source->pixels;
+	if (pixels)
+		pixels += 3 * (size_t)source->width * source->row;
+	source->row += num;
+	if (pixels)
+		return pixels;
+	long long start = timer_now();
+	int error = source->read(source->arg, buffer, num);
+	timer_stage(nanos, STAGE_READ, start);
+	return error ? 0 : buffer;
+}
+
+struct tiles {
+	const char *name;
+	const uint8_t *pixels;
+	int width;
+	int height;
+	int size;
+	int cols;
+	int first;
+	int mode;
+	uint8_t **data;
+	size_t *bytes;
+	struct stats *stats;
+};
+
+static void encode_worker(void *arg, int job)
+{
+	struct tiles *tiles = arg;
+	int index = tiles->first + job;
+	int x = index % tiles->cols * tiles->size;
+	int y = index / tiles->cols * tiles->size;
+	int top = tiles->first / tiles->cols * tiles->size;
+	int width = tiles->width - x < tiles->size ? tiles->width - x : tiles->size;
+	int height = tiles->height - y < tiles->size ? tiles->height - y : tiles->size;
+	struct tile tile;
+	transform(&tile, tiles->pixels+3*((size_t)tiles->width*(y-top)+x), width, height, tiles->width, tiles->mode, tiles->stats);
+	struct bits_writer *bits = bits_writer_memory(0, tiles->name);
+	struct vli_writer *vli = vli_writer(bits);
+	encode_tile(vli, &tile);
+	delete_vli_writer(vli);
+	delete_tile(&tile);
+	tiles->data[job] = release_writer(bits, tiles->bytes+index);
+}
+
+static int encode_picture(struct lqt *lqt, struct source *source, int width, int height, int mode, long long capacity, int tile_size, const uint8_t **data, size_t *size)
+{
+	int tile_log = tile_size ? ilog2(tile_size) : 0;
+	if (width < 1 || height < 1 || mode & ~31 || (tile_size && (tile_size < 2 || tile_size != 1 << tile_log)))
+		return 1;
+	int tile_width = tile_size && tile_size < width ? tile_size : width;
+	int tile_height = tile_size && tile_size < height ? tile_size : height;
+	int cols = (width + tile_width - 1) / tile_width;
+	int rows = (height + tile_height - 1) / tile_height;
+	if ((long long)cols * rows > INT_MAX || !quadtree_fits(tile_width, tile_height, width)) {
+		fprintf(stderr, "picture of %dx%d pixels needs tiles smaller than %dx%d pixels.\n", width, height, tile_width, tile_height);
+		return 1;
+	}
+	struct arena *outer = arena_bind(&lqt->arena);
+	struct pool *outer_pool = pool_bind(&lqt->pool);
+	struct stats *stats = &lqt->stats;
+	memset(stats, 0, sizeof(struct stats));
+	stats->mode = mode;
+	stats->width = width;
+	stats->height = height;
+	stats->tile = tile_size;
+	stats->capacity = capacity;
+	struct bits_writer *bits = 0;
+	struct vli_writer *vli = 0;
+	uint8_t *buffer = 0;
+	int error = 1;
+	if (!tile_size) {
+		if (!source->pixels)
+			buffer = arena_malloc(ARENA_IMAGE, 3 * (size_t)width * height);
+		const uint8_t *pixels = source_rows(source, buffer, height, stats->nanos);
+		if (!pixels)
+			goto end;
+		struct tile tile;
+		transform(&tile, pixels, width, height, width, mode, stats);
+		bits = bits_writer_buffer(lqt->data, lqt->data_size, capacity, lqt->name);
+		vli = vli_writer(bits);
+		put_vli(vli, mode);
+		put_vli(vli, width);
+		put_vli(vli, height);
+		put_vli(vli, 0);
+		encode_tile(vli, &tile);
+		delete_tile(&tile);
+		delete_vli_writer(vli);
+		lqt->data_size = bits->size;
+		lqt->data = release_writer(bits, size);
+	} else {
+		int num = cols * rows;
+		int group = (pool_threads() + cols - 1) / cols;
+		if (group > rows)
+			group = rows;
+		if (!source->pixels)
+			buffer = arena_malloc(ARENA_IMAGE, 3 * (size_t)width * tile_size * group);
+		struct tiles tiles = { lqt->name, 0, width, height, tile_size, cols, 0, mode, 0, 0, stats };
+		tiles.data = malloc(sizeof(uint8_t *) * group * cols);
+		tiles.bytes = malloc(sizeof(size_t) * num);
+		bits = bits_writer_buffer(lqt->data, lqt->data_size, 0, lqt->name);
+		for (int row = 0; row < rows; row += group) {
+			int count = rows - row < group ? rows - row : group;
+			int lines = height - row * tile_size < count * tile_size ? height - row * tile_size : count * tile_size;
+			tiles.pixels = source_rows(source, buffer, lines, stats->nanos);
+			if (!tiles.pixels)
+				break;
+			tiles.first = row * cols;
+			pool_run(encode_worker, &tiles, count * cols);
+			for (int job = 0; job < count * cols; ++job) {
+				write_bytes(bits, tiles.data[job], tiles.bytes[tiles.first+job]);
+				free(tiles.data[job]);
+			}
+		}
+		lqt->data_size = bits->size;
+		lqt->data = release_writer(bits, size);
+		if (tiles.pixels) {
+			bits = bits_writer_memory(0, lqt->name);
+			vli = vli_writer(bits);
+			put_vli(vli, mode);
+			put_vli(vli, width);
+			put_vli(vli, height);
+			put_vli(vli, tile_log);
+			for (int i = 0; i < num; ++i)
+				put_vli_long(vli, tiles.bytes[i]);
+			align_writer(bits);
+			delete_vli_writer(vli);
+			size_t head_size;
+			uint8_t *head = release_writer(bits, &head_size);
+			if (lqt->data_size < head_size + *size) {
+				lqt->data_size = head_size + *size;
+				lqt->data = realloc(lqt->data, lqt->data_size);
+			}
+			memmove(lqt->data + head_size, lqt->data, *size);
+			memcpy(lqt->data, head, head_size);
+			free(head);
+			*size += head_size;
+		}
+		free(tiles.data);
+		free(tiles.bytes);
+		if (!tiles.pixels)
+			goto end;
+		if (capacity > 0 && 8 * (long long)*size > capacity && lqt_truncate(lqt, lqt->data, *size, capacity, -1, data, size))
+			goto end;
+	}
+	stats->bytes = *size;
+	*data = lqt->data;
+	error = 0;
+end:
+	arena_free(ARENA_IMAGE, buffer);
+	arena_bind(outer);
+	pool_bind(outer_pool);
+	return error;
+}
+
+int lqt_encode(struct lqt *lqt, const uint8_t *pixels, int width, int height, int mode, long long capacity, int tile_size, const uint8_t **data, size_t *size)
+{
+	struct source source = { pixels, 0, 0, width, 0 };
+	return encode_picture(lqt, &source, width, height, mode, capacity, tile_size, data, size);
+}
+
+int lqt_encode_rows(struct lqt *lqt, int (*read)(void *arg, uint8_t *pixels, int rows), void *arg, int width, int height, int mode, long long capacity, int tile_size, const uint8_t **data, size_t *size)
+{
+	struct source source = { 0, read, arg, width, 0 };
+	return encode_picture(lqt, &source, width, height, mode, capacity, tile_size, data, size);
+}
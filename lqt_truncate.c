@@ -0,0 +1,235 @@
+/*
+Cutting streams to lower rates without decoding them
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#include "lqt.h"
+#include "context.h"
+#include "vli.h"
+#include "bits.h"
+#include "quadtree.h"
+#include "budget.h"
+
+/*
+A prefix of a tile decodes as far as it goes, so tiles without an index
+of their layers are simply cut short. With the index of mode 8 or 16 the
+roots, the planes and the table of a tile are copied, the table with the
+new lengths of the chunks, and the chunks are kept up to "layers" and as
+far as "limit" bytes of the output allow. The encoder finishes its coder
+at the end of each chunk, so a tile cut after a layer decodes to exactly
+the layers kept. cut_tile() returns 1 if not even the table fits, which
+leaves the plain prefix.
+*/
+
+static int copy_head(struct vli_reader *in, struct vli_writer *out, int *planes_max)
+{
+	for (int chan = 0; chan < 3; ++chan) {
+		int root = get_vli(in);
+		if (root < 0)
+			return -1;
+		put_vli(out, root);
+		if (!root)
+			continue;
+		int sign = vli_get_bit(in);
+		if (sign < 0)
+			return -1;
+		vli_put_bit(out, sign);
+	}
+	*planes_max = 0;
+	for (int chan = 0; chan < 3; ++chan) {
+		int planes = get_vli(in);
+		if (planes < 0 || planes > 15)
+			return -1;
+		put_vli(out, planes);
+		if (*planes_max < planes)
+			*planes_max = planes;
+	}
+	return 0;
+}
+
+static int cut_tile(struct vli_reader *in, struct vli_writer *out, int width, int height, int mode, long long limit, int layers)
+{
+	int depth = quadtree_depth(width, height), planes_max;
+	if (copy_head(in, out, &planes_max))
+		return -1;
+	in->bits->prefix = 1;
+	int maximum = depth > planes_max ? depth : planes_max;
+	int layers_max = 2 * maximum - 1;
+	if (layers_max < 1)
+		return 0;
+	int streams = mode & 8 ? 3 : 1, num = streams * layers_max;
+	size_t *first = calloc(2 * num, sizeof(size_t)), *length = first + num, total = 0;
+	long long table = 0;
+	for (int i = 0; i < num; ++i) {
+		long long len = get_vli_long(in);
+		if (len < 0)
+			break;
+		length[i] = len;
+		total += len;
+		table += vli_bits(len);
+	}
+	align_reader(in->bits);
+	const uint8_t *data = map_prefix(in->bits, &total);
+	long long room = limit < 0 ? (long long)total : limit - (bits_count(out->bits) + table + 7) / 8;
+	if (room < 0) {
+		free(first);
+		return 1;
+	}
+	size_t pos = 0;
+	for (int i = 0; i < num; ++i) {
+		first[i] = pos;
+		length[i] = total - pos < length[i] ? total - pos : length[i];
+		pos += length[i];
+		if (layers >= 0 && i / streams >= layers)
+			length[i] = 0;
+		if ((long long)length[i] > room)
+			length[i] = room;
+		room -= length[i];
+	}
+	for (int i = 0; i < num; ++i)
+		put_vli_long(out, length[i]);
+	align_writer(out->bits);
+	for (int i = 0; i < num; ++i)
+		write_bytes(out->bits, data + first[i], length[i]);
+	free(first);
+	return 0;
+}
+
+static void *cut_prefix(const char *name, const uint8_t *data, size_t size, long long limit, size_t *output_size)
+{
+	if (limit >= 0 && (long long)size > limit)
+		size = limit;
+	struct bits_writer *bits = bits_writer_memory(0, name);
+	write_bytes(bits, data, size);
+	return release_writer(bits, output_size);
+}
+
+static void *cut_indexed(const char *name, const uint8_t *data, size_t size, int header, int width, int height, int mode, long long limit, int layers, size_t *output_size)
+{
+	struct bits_reader *in = bits_reader_memory(data, size, name);
+	struct vli_reader *vli = vli_reader(in);
+	struct bits_writer *bits = bits_writer_memory(0, name);
+	struct vli_writer *out = vli_writer(bits);
+	for (int i = 0; i < header; ++i)
+		put_vli(out, get_vli(vli));
+	int ret = cut_tile(vli, out, width, height, mode, limit, layers);
+	delete_vli_reader(vli);
+	close_reader(in);
+	delete_vli_writer(out);
+	void *output = release_writer(bits, output_size);
+	if (ret > 0) {
+		free(output);
+		return cut_prefix(name, data, size, limit, output_size);
+	}
+	if (ret < 0) {
+		free(output);
+		return 0;
+	}
+	return output;
+}
+
+/*
+Tiles are cut like the decoder cuts them for a budget, so that a stream
+cut to a budget decodes like the whole stream decoded with that budget.
+*/
+
+int lqt_truncate(struct lqt *lqt, const uint8_t *input, size_t input_size, long long budget, int layers, const uint8_t **data, size_t *size)
+{
+	struct bits_reader *bits = bits_reader_memory(input, input_size, lqt->name);
+	struct vli_reader *vli = vli_reader(bits);
+	int mode = get_vli(vli);
+	int width = get_vli(vli);
+	int height = get_vli(vli);
+	int tile_log = get_vli(vli);
+	long long limit = budget < 0 ? -1 : (budget + 7) / 8;
+	uint8_t *output = 0;
+	size_t output_size = 0;
+	if ((mode|tile_log) < 0 || width < 1 || height < 1 || mode & ~31 || tile_log > 30)
+		goto end;
+	if (layers >= 0 && !(mode & 24)) {
+		fprintf(stderr, "stream has no index of its layers.\n");
+		goto end;
+	}
+	if (!tile_log) {
+		if (limit >= 0 && limit < budget_head(input, input_size, 4)) {
+			fprintf(stderr, "budget of %lld bits too small for the roots and planes.\n", budget);
+			goto end;
+		}
+		if (mode & 24)
+			output = cut_indexed(lqt->name, input, input_size, 4, width, height, mode, limit, layers, &output_size);
+		else
+			output = cut_prefix(lqt->name, input, input_size, limit, &output_size);
+		goto end;
+	}
+	int tile_size = 1 << tile_log;
+	int cols = (width + tile_size - 1) / tile_size;
+	int rows = (height + tile_size - 1) / tile_size;
+	if ((long long)cols * rows > INT_MAX)
+		goto end;
+	int num = cols * rows;
+	size_t *sizes = malloc(sizeof(size_t) * 3 * num), *shares = sizes + num, *cuts = shares + num, total = 0;
+	uint8_t **tiles = calloc(num, sizeof(uint8_t *));
+	for (int i = 0; i < num; ++i) {
+		long long bytes = get_vli_long(vli);
+		if (bytes < 0)
+			goto done;
+		sizes[i] = bytes;
+		total += bytes;
+	}
+	align_reader(bits);
+	long long header = bits_offset(bits);
+	const uint8_t *tile = map_prefix(bits, &total);
+	for (int i = 0; i < num; ++i) {
+		if (sizes[i] > total)
+			sizes[i] = total;
+		total -= sizes[i];
+	}
+	memcpy(shares, sizes, sizeof(size_t) * num);
+	if (limit >= 0 && budget_tiles(tile, shares, num, limit - header)) {
+		fprintf(stderr, "budget of %lld bits too small for %d tiles.\n", budget, num);
+		goto done;
+	}
+	for (int i = 0; i < num; ++i) {
+		long long share = shares[i] < sizes[i] ? (long long)shares[i] : -1;
+		int x = i % cols * tile_size, y = i / cols * tile_size;
+		int w = width - x < tile_size ? width - x : tile_size;
+		int h = height - y < tile_size ? height - y : tile_size;
+		if (mode & 24)
+			tiles[i] = cut_indexed(lqt->name, tile, sizes[i], 0, w, h, mode, share, layers, cuts+i);
+		else
+			tiles[i] = cut_prefix(lqt->name, tile, sizes[i], share, cuts+i);
+		if (!tiles[i])
+			goto done;
+		tile += sizes[i];
+	}
+	struct bits_writer *writer = bits_writer_memory(0, lqt->name);
+	struct vli_writer *out = vli_writer(writer);
+	put_vli(out, mode);
+	put_vli(out, width);
+	put_vli(out, height);
+	put_vli(out, tile_log);
+	for (int i = 0; i < num; ++i)
+		put_vli_long(out, cuts[i]);
+	align_writer(writer);
+	for (int i = 0; i < num; ++i)
+		write_bytes(writer, tiles[i], cuts[i]);
+	delete_vli_writer(out);
+	output = release_writer(writer, &output_size);
+done:
+	for (int i = 0; i < num; ++i)
+		free(tiles[i]);
+	free(tiles);
+	free(sizes);
+end:
+	delete_vli_reader(vli);
+	close_reader(bits);
+	if (!output)
+		return 1;
+	free(lqt->data);
+	lqt->data = output;
+	lqt->data_size = output_size;
+	*data = output;
+	*size = output_size;
+	return 0;
+}
@@ -0,0 +1,191 @@
+/*
+Run independent jobs on a pool of worker threads
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+A pool is bound to a thread like an arena, by the context that owns it.
+Its workers are started by the first pool_run() that has more than one
+job for them and wait for the jobs of the next call until pool_stop()
+joins them. The calling thread takes jobs as well and returns when the
+last one is done. Without a bound pool the jobs run on the calling thread.
+*/
+
+struct pool {
+	void (*work)(void *, int);
+	void *data;
+	int next;
+	int num;
+	int busy;
+	int round;
+	int quit;
+	int threads;
+	int started;
+	pthread_t *tids;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+};
+
+static inline int pool_threads(void)
+{
+	long num = sysconf(_SC_NPROCESSORS_ONLN);
+	return num > 0 ? num : 1;
+}
+
+/*
+Workers set lqt_pool_inside, so that pool_run() calls nested in a job, like
+the tiles of a picture in a batch, run on the calling thread. The library
+and the programs share it, which is why it is defined once in lqt.c and
+carries the prefix of the library.
+*/
+
+extern __thread int lqt_pool_inside;
+
+static __thread struct pool *pool_bound;
+
+static inline struct pool *pool_bind(struct pool *pool)
+{
+	struct pool *prev = pool_bound;
+	pool_bound = pool;
+	return prev;
+}
+
+static inline void pool_jobs(struct pool *pool)
+{
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		int job = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (job >= pool->num)
+			break;
+		pool->work(pool->data, job);
+	}
+}
+
+static inline void *pool_worker(void *arg)
+{
+	struct pool *pool = arg;
+	lqt_pool_inside = 1;
+	int round = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->round == round && !pool->quit)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->quit)
+			break;
+		round = pool->round;
+		pthread_mutex_unlock(&pool->lock);
+		pool_jobs(pool);
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->busy)
+			pthread_cond_signal(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static inline void pool_start(struct pool *pool)
+{
+	pthread_mutex_init(&pool->lock, 0);
+	pthread_cond_init(&pool->wake, 0);
+	pthread_cond_init(&pool->idle, 0);
+	pool->started = 1;
+	pool->round = 0;
+	pool->tids = malloc(sizeof(pthread_t) * pool_threads());
+	pool->threads = 0;
+	while (pool->threads < pool_threads() - 1 && !pthread_create(pool->tids+pool->threads, 0, pool_worker, pool))
+		++pool->threads;
+}
+
+static inline void pool_stop(struct pool *pool)
+{
+	if (!pool->started)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->threads; ++i)
+		pthread_join(pool->tids[i], 0);
+	free(pool->tids);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->idle);
+	pool->started = 0;
+	pool->quit = 0;
+}
+
+static inline void pool_run(void (*work)(void *, int), void *data, int num)
+{
+	struct pool *pool = pool_bound;
+	if (!pool || lqt_pool_inside || num < 2) {
+		for (int job = 0; job < num; ++job)
+			work(data, job);
+		return;
+	}
+	if (!pool->started)
+		pool_start(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->work = work;
+	pool->data = data;
+	pool->next = 0;
+	pool->num = num;
+	pool->busy = pool->threads;
+	++pool->round;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	lqt_pool_inside = 1;
+	pool_jobs(pool);
+	lqt_pool_inside = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+Run work(data, part, begin, end) for each of the parts, with the range
+of num elements split into bands for the workers, if it is big enough.
+Nested calls from inside a worker run on the calling thread.
+*/
+
+struct pool_split {
+	void (*work)(void *, int, int, int);
+	void *data;
+	int num;
+	int bands;
+};
+
+static inline void pool_split_worker(void *arg, int job)
+{
+	struct pool_split *split = arg;
+	int part = job / split->bands;
+	int band = job % split->bands;
+	int begin = (long long)split->num * band / split->bands;
+	int end = (long long)split->num * (band + 1) / split->bands;
+	split->work(split->data, part, begin, end);
+}
+
+static inline void pool_split(void (*work)(void *, int, int, int), void *data, int parts, int num)
+{
+	int bands = num / 65536 + 1;
+	int threads = !pool_bound || lqt_pool_inside || (long long)parts * num < 65536 ? 1 : pool_threads();
+	if (bands > threads)
+		bands = threads;
+	struct pool_split split = { work, data, num, bands };
+	if (threads == 1) {
+		for (int part = 0; part < parts; ++part)
+			work(data, part, 0, num);
+		return;
+	}
+	pool_run(pool_split_worker, &split, parts * bands);
+}
+
@@ -9,22 +9,43 @@ Copyright 2014 Ahmet Inan <xdsopl@gmail.com>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include "image.h"
+#include <stdint.h>
 
-struct image *read_ppm(char *name)
+/*
+open_ppm() reads the header of a P6 or P5 file and read_ppm_rows() the
+next rows of its raster into three bytes per pixel, repeating the grey
+of P5 for all three. The codec only handles 8 bit samples and files
+with more bits are rejected, as rounding them would not be lossless.
+Their samples do not fit the 16 bit coefficients of the codec.
+The rows are read as a whole and converted in place.
+*/
+
+struct ppm_reader {
+	FILE *file;
+	char *name;
+	int width, height, channels;
+};
+
+static inline void close_ppm(struct ppm_reader *ppm)
+{
+	fclose(ppm->file);
+	free(ppm);
+}
+
+static inline struct ppm_reader *open_ppm(char *name)
 {
 	FILE *file = fopen(name, "r");
 	if (!file) {
 		fprintf(stderr, "could not open \"%s\" file to read.\n", name);
 		return 0;
 	}
-	if ('P' != fgetc(file) || '6' != fgetc(file)) {
-		fprintf(stderr, "file \"%s\" not P6 image.\n", name);
+	int format = 0;
+	if ('P' != fgetc(file) || ('5' != (format = fgetc(file)) && '6' != format)) {
+		fprintf(stderr, "file \"%s\" not P6 or P5 image.\n", name);
 		fclose(file);
 		return 0;
 	}
 	int integer[3];
-	struct image *image = 0;
 	int c = fgetc(file);
 	if (EOF == c)
 		goto eof;
@@ -55,52 +76,73 @@ struct image *read_ppm(char *name)
 		return 0;
 	}
 	if (integer[2] != 255) {
-		fprintf(stderr, "cant read \"%s\", only 8 bit per channel SRGB supported at the moment.\n", name);
+		fprintf(stderr, "cant read \"%s\", only 8 bit per channel supported at the moment.\n", name);
 		fclose(file);
 		return 0;
 	}
-	image = new_image(name, integer[0], integer[1]);
-	for (int i = 0; i < 3 * image->total; i++) {
-		int v = fgetc(file);
-		if (EOF == v)
-			goto eof;
-		image->buffer[i] = v;
-	}
-	fclose(file);
-	return image;
+	struct ppm_reader *ppm = malloc(sizeof(struct ppm_reader));
+	ppm->file = file;
+	ppm->name = name;
+	ppm->width = integer[0];
+	ppm->height = integer[1];
+	ppm->channels = format == '6' ? 3 : 1;
+	return ppm;
 eof:
 	fprintf(stderr, "EOF while reading from \"%s\".\n", name);
 	fclose(file);
-	delete_image(image);
 	return 0;
 }
 
-int clamp(int x, int a, int b)
+static inline int read_ppm_rows(struct ppm_reader *ppm, uint8_t *pixels, int rows)
 {
-	return x < a ? a : x > b ? b : x;
+	size_t total = (size_t)ppm->width * rows;
+	size_t bytes = ppm->channels * total;
+	uint8_t *raster = pixels + 3 * total - bytes;
+	if (bytes != fread(raster, 1, bytes, ppm->file)) {
+		fprintf(stderr, "EOF while reading from \"%s\".\n", ppm->name);
+		return -1;
+	}
+	if (ppm->channels == 1)
+		for (size_t i = 0; i < total; ++i)
+			pixels[3*i] = pixels[3*i+1] = pixels[3*i+2] = raster[i];
+	return 0;
 }
 
-int write_ppm(struct image *image)
+static inline uint8_t *read_ppm(char *name, int *width, int *height)
 {
-	FILE *file = fopen(image->name, "w");
+	struct ppm_reader *ppm = open_ppm(name);
+	if (!ppm)
+		return 0;
+	uint8_t *pixels = malloc(3 * (size_t)ppm->width * ppm->height);
+	if (read_ppm_rows(ppm, pixels, ppm->height)) {
+		free(pixels);
+		close_ppm(ppm);
+		return 0;
+	}
+	*width = ppm->width;
+	*height = ppm->height;
+	close_ppm(ppm);
+	return pixels;
+}
+
+static inline int write_ppm(char *name, const uint8_t *pixels, int width, int height)
+{
+	FILE *file = fopen(name, "w");
 	if (!file) {
-		fprintf(stderr, "could not open \"%s\" file to write.\n", image->name);
+		fprintf(stderr, "could not open \"%s\" file to write.\n", name);
 		return 0;
 	}
-	if (!fprintf(file, "P6 %d %d 255\n", image->width, image->height)) {
-		fprintf(stderr, "could not write to file \"%s\".\n", image->name);
+	if (!fprintf(file, "P6 %d %d 255\n", width, height)) {
+		fprintf(stderr, "could not write to file \"%s\".\n", name);
 		fclose(file);
 		return 0;
 	}
-	for (int i = 0; i < 3 * image->total; i++) {
-		if (EOF == fputc(clamp(image->buffer[i], 0, 255), file))
-			goto eof;
+	size_t size = 3 * (size_t)width * height;
+	if (size != fwrite(pixels, 1, size, file)) {
+		fprintf(stderr, "EOF while writing to \"%s\".\n", name);
+		fclose(file);
+		return 0;
 	}
 	fclose(file);
 	return 1;
-eof:
-	fprintf(stderr, "EOF while writing to \"%s\".\n", image->name);
-	fclose(file);
-	return 0;
 }
-
@@ -0,0 +1,183 @@
+/*
+Averaging and restoring runs of nodes with four children each
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+average() replaces the four children child[4*i..4*i+3] of each of the
+num nodes with their residuals and stores the average, rounded half
+away from zero, in node[i]. restore() adds the averages back.
+Values are 16 bits wide, sums are computed with 32 bits.
+The AVX2 and SSE4.1 versions are picked at runtime, if available.
+*/
+
+static inline void average_scalar(int16_t *node, int16_t *child, int num)
+{
+	for (int i = 0; i < num; ++i, child += 4) {
+		int sum = child[0] + child[1] + child[2] + child[3];
+		if (sum < 0)
+			sum -= 2;
+		else
+			sum += 2;
+		int avg = sum / 4;
+		node[i] = avg;
+		for (int k = 0; k < 4; ++k)
+			child[k] -= avg;
+	}
+}
+
+static inline void restore_scalar(int16_t *node, int16_t *child, int num)
+{
+	for (int i = 0; i < num; ++i, child += 4)
+		for (int k = 0; k < 4; ++k)
+			child[k] += node[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline __m256i average_avx2_round(__m256i sum)
+{
+	__m256i sgn = _mm256_srai_epi32(sum, 31);
+	__m256i val = _mm256_add_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(2)), _mm256_slli_epi32(sgn, 2));
+	__m256i neg = _mm256_and_si256(_mm256_srai_epi32(val, 31), _mm256_set1_epi32(3));
+	return _mm256_srai_epi32(_mm256_add_epi32(val, neg), 2);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i spread_avx2(__m256i quad)
+{
+	__m256i spread = _mm256_setr_epi8(
+		0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 2, 3, 2, 3, 2, 3,
+		4, 5, 4, 5, 4, 5, 4, 5, 6, 7, 6, 7, 6, 7, 6, 7);
+	return _mm256_shuffle_epi8(quad, spread);
+}
+
+__attribute__((target("avx2")))
+static inline void average_avx2(int16_t *node, int16_t *child, int num)
+{
+	__m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i ones = _mm256_set1_epi16(1);
+	int i = 0;
+	for (; i + 16 <= num; i += 16, child += 64) {
+		__m256i val[4], sum[4];
+		for (int k = 0; k < 4; ++k) {
+			val[k] = _mm256_loadu_si256((__m256i *)(child + 16 * k));
+			sum[k] = _mm256_madd_epi16(val[k], ones);
+		}
+		__m256i lo = average_avx2_round(_mm256_hadd_epi32(sum[0], sum[1]));
+		__m256i hi = average_avx2_round(_mm256_hadd_epi32(sum[2], sum[3]));
+		__m256i avg = _mm256_permutevar8x32_epi32(_mm256_packs_epi32(lo, hi), order);
+		_mm256_storeu_si256((__m256i *)(node + i), avg);
+		_mm256_storeu_si256((__m256i *)(child + 0), _mm256_sub_epi16(val[0], spread_avx2(_mm256_permute4x64_epi64(avg, 0x00))));
+		_mm256_storeu_si256((__m256i *)(child + 16), _mm256_sub_epi16(val[1], spread_avx2(_mm256_permute4x64_epi64(avg, 0x55))));
+		_mm256_storeu_si256((__m256i *)(child + 32), _mm256_sub_epi16(val[2], spread_avx2(_mm256_permute4x64_epi64(avg, 0xaa))));
+		_mm256_storeu_si256((__m256i *)(child + 48), _mm256_sub_epi16(val[3], spread_avx2(_mm256_permute4x64_epi64(avg, 0xff))));
+	}
+	average_scalar(node + i, child, num - i);
+}
+
+__attribute__((target("avx2")))
+static inline void restore_avx2(int16_t *node, int16_t *child, int num)
+{
+	int i = 0;
+	for (; i + 16 <= num; i += 16, child += 64) {
+		__m256i avg = _mm256_loadu_si256((__m256i *)(node + i));
+		_mm256_storeu_si256((__m256i *)(child + 0), _mm256_add_epi16(_mm256_loadu_si256((__m256i *)(child + 0)), spread_avx2(_mm256_permute4x64_epi64(avg, 0x00))));
+		_mm256_storeu_si256((__m256i *)(child + 16), _mm256_add_epi16(_mm256_loadu_si256((__m256i *)(child + 16)), spread_avx2(_mm256_permute4x64_epi64(avg, 0x55))));
+		_mm256_storeu_si256((__m256i *)(child + 32), _mm256_add_epi16(_mm256_loadu_si256((__m256i *)(child + 32)), spread_avx2(_mm256_permute4x64_epi64(avg, 0xaa))));
+		_mm256_storeu_si256((__m256i *)(child + 48), _mm256_add_epi16(_mm256_loadu_si256((__m256i *)(child + 48)), spread_avx2(_mm256_permute4x64_epi64(avg, 0xff))));
+	}
+	restore_scalar(node + i, child, num - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i average_sse4_round(__m128i sum)
+{
+	__m128i sgn = _mm_srai_epi32(sum, 31);
+	__m128i val = _mm_add_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), _mm_slli_epi32(sgn, 2));
+	__m128i neg = _mm_and_si128(_mm_srai_epi32(val, 31), _mm_set1_epi32(3));
+	return _mm_srai_epi32(_mm_add_epi32(val, neg), 2);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i spread_sse4(__m128i pair)
+{
+	__m128i spread = _mm_setr_epi8(0, 1, 0, 1, 0, 1, 0, 1, 2, 3, 2, 3, 2, 3, 2, 3);
+	return _mm_shuffle_epi8(pair, spread);
+}
+
+__attribute__((target("sse4.1")))
+static inline void average_sse4(int16_t *node, int16_t *child, int num)
+{
+	__m128i ones = _mm_set1_epi16(1);
+	int i = 0;
+	for (; i + 8 <= num; i += 8, child += 32) {
+		__m128i val[4], sum[4];
+		for (int k = 0; k < 4; ++k) {
+			val[k] = _mm_loadu_si128((__m128i *)(child + 8 * k));
+			sum[k] = _mm_madd_epi16(val[k], ones);
+		}
+		__m128i lo = average_sse4_round(_mm_hadd_epi32(sum[0], sum[1]));
+		__m128i hi = average_sse4_round(_mm_hadd_epi32(sum[2], sum[3]));
+		__m128i avg = _mm_packs_epi32(lo, hi);
+		_mm_storeu_si128((__m128i *)(node + i), avg);
+		_mm_storeu_si128((__m128i *)(child + 0), _mm_sub_epi16(val[0], spread_sse4(_mm_shuffle_epi32(avg, 0x00))));
+		_mm_storeu_si128((__m128i *)(child + 8), _mm_sub_epi16(val[1], spread_sse4(_mm_shuffle_epi32(avg, 0x55))));
+		_mm_storeu_si128((__m128i *)(child + 16), _mm_sub_epi16(val[2], spread_sse4(_mm_shuffle_epi32(avg, 0xaa))));
+		_mm_storeu_si128((__m128i *)(child + 24), _mm_sub_epi16(val[3], spread_sse4(_mm_shuffle_epi32(avg, 0xff))));
+	}
+	average_scalar(node + i, child, num - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline void restore_sse4(int16_t *node, int16_t *child, int num)
+{
+	int i = 0;
+	for (; i + 8 <= num; i += 8, child += 32) {
+		__m128i avg = _mm_loadu_si128((__m128i *)(node + i));
+		_mm_storeu_si128((__m128i *)(child + 0), _mm_add_epi16(_mm_loadu_si128((__m128i *)(child + 0)), spread_sse4(_mm_shuffle_epi32(avg, 0x00))));
+		_mm_storeu_si128((__m128i *)(child + 8), _mm_add_epi16(_mm_loadu_si128((__m128i *)(child + 8)), spread_sse4(_mm_shuffle_epi32(avg, 0x55))));
+		_mm_storeu_si128((__m128i *)(child + 16), _mm_add_epi16(_mm_loadu_si128((__m128i *)(child + 16)), spread_sse4(_mm_shuffle_epi32(avg, 0xaa))));
+		_mm_storeu_si128((__m128i *)(child + 24), _mm_add_epi16(_mm_loadu_si128((__m128i *)(child + 24)), spread_sse4(_mm_shuffle_epi32(avg, 0xff))));
+	}
+	restore_scalar(node + i, child, num - i);
+}
+
+static inline void average(int16_t *node, int16_t *child, int num)
+{
+	if (__builtin_cpu_supports("avx2"))
+		average_avx2(node, child, num);
+	else if (__builtin_cpu_supports("sse4.1"))
+		average_sse4(node, child, num);
+	else
+		average_scalar(node, child, num);
+}
+
+static inline void restore(int16_t *node, int16_t *child, int num)
+{
+	if (__builtin_cpu_supports("avx2"))
+		restore_avx2(node, child, num);
+	else if (__builtin_cpu_supports("sse4.1"))
+		restore_sse4(node, child, num);
+	else
+		restore_scalar(node, child, num);
+}
+#else
+static inline void average(int16_t *node, int16_t *child, int num)
+{
+	average_scalar(node, child, num);
+}
+
+static inline void restore(int16_t *node, int16_t *child, int num)
+{
+	restore_scalar(node, child, num);
+}
+#endif
+
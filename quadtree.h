@@ -0,0 +1,204 @@
+/*
+Quadtree levels of a rectangular picture in Hilbert order
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include "hilbert.h"
+
+/*
+Level l of a picture of depth d has ceil(width / 2^(d-l)) columns and
+ceil(height / 2^(d-l)) rows of nodes. Only nodes inside the picture are
+stored, level after level and each level in Hilbert order, so the
+children of a node directly follow the children of its predecessor.
+Nodes on the right or bottom border with less than four children are
+listed in "edge" as pairs of node index and number of children.
+"leaf" maps the last level to the pixel offsets y * pitch + x.
+*/
+
+struct quadtree {
+	int width;
+	int height;
+	int pitch;
+	int depth;
+	int total;
+	int *cols;
+	int *rows;
+	int *size;
+	int *offset;
+	int *leaf;
+	int **edge;
+	int *edges;
+	int users;
+	int stamp;
+};
+
+static inline void quadtree_walk(struct quadtree *qt, int *cursor, int level, int x, int y, int s)
+{
+	int index = cursor[level]++;
+	if (level == qt->depth) {
+		qt->leaf[index] = qt->pitch * y + x;
+		return;
+	}
+	int cols = qt->cols[level+1];
+	int rows = qt->rows[level+1];
+	int cnt = 0;
+	for (int k = 0; k < 4; ++k) {
+		int q = hilbert_quad[s][k];
+		if (2*x+(q&1) < cols && 2*y+(q>>1) < rows)
+			++cnt;
+	}
+	if (cnt < 4) {
+		int *edge = qt->edge[level] + 2 * qt->edges[level]++;
+		edge[0] = index;
+		edge[1] = cnt;
+	}
+	for (int k = 0; k < 4; ++k) {
+		int q = hilbert_quad[s][k];
+		int cx = 2*x+(q&1), cy = 2*y+(q>>1);
+		if (cx < cols && cy < rows)
+			quadtree_walk(qt, cursor, level+1, cx, cy, hilbert_next[s][k]);
+	}
+}
+
+static inline int first_child(struct quadtree *qt, int level, int index, int **edge)
+{
+	int *last = qt->edge[level] + 2 * qt->edges[level];
+	int child = 4 * index;
+	for (*edge = qt->edge[level]; *edge < last && **edge < index; *edge += 2)
+		child -= 4 - (*edge)[1];
+	return child;
+}
+
+static inline int quadtree_depth(int width, int height)
+{
+	int depth = 0;
+	while (1LL << depth < width || 1LL << depth < height)
+		++depth;
+	return depth;
+}
+
+/*
+Nodes and pixel offsets are indexed with int, which keeps the tables
+and the loops over them small. quadtree_fits() tells if a picture stays
+below 2^31 nodes and offsets, which larger pictures only do with tiles.
+*/
+
+static inline int quadtree_fits(int width, int height, int pitch)
+{
+	int depth = quadtree_depth(width, height);
+	long long total = 0;
+	for (int shift = 0; shift <= depth; ++shift)
+		total += ((width + (1LL << shift) - 1) >> shift) * ((height + (1LL << shift) - 1) >> shift);
+	return total <= INT_MAX && (long long)pitch * (height - 1) + width <= INT_MAX;
+}
+
+static inline struct quadtree *new_quadtree(int width, int height, int pitch)
+{
+	struct quadtree *qt = malloc(sizeof(struct quadtree));
+	int depth = quadtree_depth(width, height);
+	qt->width = width;
+	qt->height = height;
+	qt->pitch = pitch;
+	qt->depth = depth;
+	qt->cols = malloc(sizeof(int) * 5 * (depth + 1));
+	qt->rows = qt->cols + depth + 1;
+	qt->size = qt->rows + depth + 1;
+	qt->offset = qt->size + depth + 1;
+	qt->edges = qt->offset + depth + 1;
+	qt->edge = malloc(sizeof(int *) * (depth + 1));
+	int edges = 0;
+	qt->total = 0;
+	for (int level = 0; level <= depth; ++level) {
+		int shift = depth - level;
+		qt->cols[level] = (width + (1LL << shift) - 1) >> shift;
+		qt->rows[level] = (height + (1LL << shift) - 1) >> shift;
+		qt->size[level] = qt->cols[level] * qt->rows[level];
+		qt->offset[level] = qt->total;
+		qt->total += qt->size[level];
+		qt->edges[level] = 0;
+		edges += 2 * (qt->cols[level] + qt->rows[level]);
+	}
+	qt->edge[0] = malloc(sizeof(int) * edges);
+	for (int level = 1; level <= depth; ++level)
+		qt->edge[level] = qt->edge[level-1] + 2 * (qt->cols[level-1] + qt->rows[level-1]);
+	qt->leaf = malloc(sizeof(int) * qt->size[depth]);
+	int *cursor = calloc(depth + 1, sizeof(int));
+	quadtree_walk(qt, cursor, 0, 0, 0, 0);
+	free(cursor);
+	qt->users = 0;
+	qt->stamp = 0;
+	return qt;
+}
+
+static inline void delete_quadtree(struct quadtree *qt)
+{
+	free(qt->leaf);
+	free(qt->edge[0]);
+	free(qt->edge);
+	free(qt->cols);
+	free(qt);
+}
+
+/*
+Shapes are cached, as consecutive pictures and tiles of a picture
+mostly share the same dimensions. Unused entries get replaced first.
+*/
+
+#define QUADTREE_CACHE 16
+
+static struct quadtree *quadtree_cache[QUADTREE_CACHE];
+static pthread_mutex_t quadtree_lock = PTHREAD_MUTEX_INITIALIZER;
+static int quadtree_stamp;
+
+static inline struct quadtree *get_quadtree(int width, int height, int pitch)
+{
+	pthread_mutex_lock(&quadtree_lock);
+	struct quadtree *qt = 0;
+	for (int i = 0; i < QUADTREE_CACHE && !qt; ++i)
+		if (quadtree_cache[i] && quadtree_cache[i]->width == width && quadtree_cache[i]->height == height && quadtree_cache[i]->pitch == pitch)
+			qt = quadtree_cache[i];
+	if (!qt) {
+		int slot = -1;
+		for (int i = 0; i < QUADTREE_CACHE && slot < 0; ++i)
+			if (!quadtree_cache[i])
+				slot = i;
+		for (int i = 0; i < QUADTREE_CACHE && slot < 0; ++i)
+			if (!quadtree_cache[i]->users)
+				slot = i;
+		for (int i = slot + 1; slot >= 0 && i < QUADTREE_CACHE; ++i)
+			if (quadtree_cache[slot] && !quadtree_cache[i]->users && quadtree_cache[i]->stamp < quadtree_cache[slot]->stamp)
+				slot = i;
+		qt = new_quadtree(width, height, pitch);
+		if (slot < 0) {
+			qt->users = -1;
+		} else {
+			if (quadtree_cache[slot])
+				delete_quadtree(quadtree_cache[slot]);
+			quadtree_cache[slot] = qt;
+		}
+	}
+	if (qt->users >= 0) {
+		qt->users += 1;
+		qt->stamp = ++quadtree_stamp;
+	}
+	pthread_mutex_unlock(&quadtree_lock);
+	return qt;
+}
+
+static inline void put_quadtree(struct quadtree *qt)
+{
+	pthread_mutex_lock(&quadtree_lock);
+	int cached = qt->users > 0;
+	if (cached)
+		qt->users -= 1;
+	pthread_mutex_unlock(&quadtree_lock);
+	if (!cached)
+		delete_quadtree(qt);
+}
+
@@ -0,0 +1,176 @@
+/*
+Adaptive binary range coding
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <limits.h>
+#include "bits.h"
+
+/*
+Each bit is coded with the probability of it being zero, kept in 12 bits
+and adapted to the coded bits. The writer starts at a byte boundary and
+stops before a bit would need more bytes than the capacity of the stream
+allows, counting the four bytes the flush adds at the end. The reader
+needs as many bytes for a bit as the writer did, so a bit is only taken
+if all of its bytes could be read and a truncated stream decodes as far
+as it goes, like the run length coding does.
+*/
+
+#define RAC_BITS 12
+#define RAC_HALF (1 << (RAC_BITS - 1))
+#define RAC_RATE 5
+#define RAC_TOP (1 << 24)
+
+struct rac_reader {
+	struct bits_reader *bits;
+	uint32_t range;
+	uint32_t code;
+	int error;
+};
+
+struct rac_writer {
+	struct bits_writer *bits;
+	uint64_t low;
+	uint32_t range;
+	int cache;
+	int pending;
+	int skip;
+	long long count;
+	long long budget;
+	int error;
+};
+
+static inline void rac_probs(uint16_t *prob, int num)
+{
+	for (int i = 0; i < num; ++i)
+		prob[i] = RAC_HALF;
+}
+
+static inline int rac_byte(struct rac_reader *rac)
+{
+	int byte;
+	if (rac->error || read_bits(rac->bits, &byte, 8)) {
+		rac->error = -1;
+		return 0;
+	}
+	return byte;
+}
+
+static inline struct rac_reader *rac_reader(struct bits_reader *bits)
+{
+	struct rac_reader *rac = malloc(sizeof(struct rac_reader));
+	rac->bits = bits;
+	rac->range = ~(uint32_t)0;
+	rac->code = 0;
+	rac->error = 0;
+	align_reader(bits);
+	for (int i = 0; i < 4 && !rac->error; ++i)
+		rac->code = rac->code << 8 | rac_byte(rac);
+	return rac;
+}
+
+static inline struct rac_writer *rac_writer(struct bits_writer *bits)
+{
+	struct rac_writer *rac = malloc(sizeof(struct rac_writer));
+	rac->bits = bits;
+	rac->low = 0;
+	rac->range = ~(uint32_t)0;
+	rac->cache = 0;
+	rac->pending = 1;
+	rac->skip = 1;
+	rac->count = 0;
+	rac->error = align_writer(bits);
+	rac->budget = LLONG_MAX;
+	if (bits->cap > 0)
+		rac->budget = (bits->cap - bits_count(bits)) / 8 - 4;
+	return rac;
+}
+
+static inline void delete_rac_reader(struct rac_reader *rac)
+{
+	free(rac);
+}
+
+static inline int rac_shift(struct rac_writer *rac)
+{
+	if ((uint32_t)rac->low < 0xff000000 || rac->low >> 32) {
+		int carry = rac->low >> 32;
+		for (int byte = rac->cache; rac->pending; --rac->pending, byte = 0xff) {
+			if (rac->skip) {
+				rac->skip = 0;
+				continue;
+			}
+			int ret = write_bits(rac->bits, byte + carry, 8);
+			if (ret)
+				return ret;
+		}
+		rac->cache = (rac->low >> 24) & 0xff;
+	}
+	rac->pending += 1;
+	rac->low = (rac->low & 0x00ffffff) << 8;
+	return 0;
+}
+
+static inline int rac_flush(struct rac_writer *rac)
+{
+	for (int i = 0; i < 5; ++i) {
+		int ret = rac_shift(rac);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static inline void delete_rac_writer(struct rac_writer *rac)
+{
+	free(rac);
+}
+
+static inline int put_rac(struct rac_writer *rac, uint16_t *prob, int bit)
+{
+	if (rac->error)
+		return rac->error;
+	uint32_t bound = (rac->range >> RAC_BITS) * *prob;
+	uint32_t range = bit ? rac->range - bound : bound;
+	int shifts = 0;
+	for (uint32_t r = range; r < RAC_TOP; r <<= 8)
+		++shifts;
+	if (shifts > rac->budget - rac->count)
+		return rac->error = -2;
+	if (bit) {
+		rac->low += bound;
+		*prob -= *prob >> RAC_RATE;
+	} else {
+		*prob += ((1 << RAC_BITS) - *prob) >> RAC_RATE;
+	}
+	rac->range = range << 8 * shifts;
+	rac->count += shifts;
+	while (shifts--)
+		if ((rac->error = rac_shift(rac)))
+			return rac->error;
+	return 0;
+}
+
+static inline int get_rac(struct rac_reader *rac, uint16_t *prob)
+{
+	if (rac->error)
+		return rac->error;
+	uint32_t bound = (rac->range >> RAC_BITS) * *prob;
+	int bit = rac->code >= bound;
+	if (bit) {
+		rac->code -= bound;
+		rac->range -= bound;
+		*prob -= *prob >> RAC_RATE;
+	} else {
+		rac->range = bound;
+		*prob += ((1 << RAC_BITS) - *prob) >> RAC_RATE;
+	}
+	while (rac->range < RAC_TOP) {
+		rac->range <<= 8;
+		rac->code = rac->code << 8 | rac_byte(rac);
+	}
+	return rac->error ? rac->error : bit;
+}
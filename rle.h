@@ -6,19 +6,29 @@ Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
 
 #pragma once
 
+#include <stdint.h>
 #include "vli.h"
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
 
 struct rle_reader {
 	struct vli_reader *vli;
 	int cnt;
 };
 
+/*
+runs[n] counts the runs written with n bits, the runs of length zero
+being in runs[0].
+*/
+
 struct rle_writer {
 	struct vli_writer *vli;
 	int cnt;
+	int runs[32];
 };
 
-struct rle_reader *rle_reader(struct vli_reader *vli)
+static inline struct rle_reader *rle_reader(struct vli_reader *vli)
 {
 	struct rle_reader *rle = malloc(sizeof(struct rle_reader));
 	rle->vli = vli;
@@ -26,44 +36,44 @@ struct rle_reader *rle_reader(struct vli_reader *vli)
 	return rle;
 }
 
-struct rle_writer *rle_writer(struct vli_writer *vli)
+static inline struct rle_writer *rle_writer(struct vli_writer *vli)
 {
-	struct rle_writer *rle = malloc(sizeof(struct rle_writer));
+	struct rle_writer *rle = calloc(1, sizeof(struct rle_writer));
 	rle->vli = vli;
-	rle->cnt = 0;
 	return rle;
 }
 
-int rle_flush(struct rle_writer *rle)
+static inline int rle_flush(struct rle_writer *rle)
 {
+	++rle->runs[rle->cnt ? 32 - __builtin_clz(rle->cnt) : 0];
 	return rle->cnt = put_vli(rle->vli, rle->cnt);
 }
 
-void delete_rle_reader(struct rle_reader *rle)
+static inline void delete_rle_reader(struct rle_reader *rle)
 {
 	if (rle->cnt > 1)
 		fprintf(stderr, "%d zeros not read.\n", rle->cnt);
 	free(rle);
 }
 
-void delete_rle_writer(struct rle_writer *rle)
+static inline void delete_rle_writer(struct rle_writer *rle)
 {
 	if (rle->cnt > 0)
 		fprintf(stderr, "forgot to flush counter for %d zeros.\n", rle->cnt);
 	free(rle);
 }
 
-int put_rle(struct rle_writer *rle, int b)
+static inline int put_rle(struct rle_writer *rle, int b)
 {
 	if (rle->cnt < 0)
 		return rle->cnt;
 	if (b)
-		return rle->cnt = put_vli(rle->vli, rle->cnt);
+		return rle_flush(rle);
 	rle->cnt++;
 	return 0;
 }
 
-int get_rle(struct rle_reader *rle)
+static inline int get_rle(struct rle_reader *rle)
 {
 	if (rle->cnt < 0)
 		return rle->cnt;
@@ -76,7 +86,7 @@ int get_rle(struct rle_reader *rle)
 	return rle->cnt-- == 1;
 }
 
-int rle_put_bit(struct rle_writer *rle, int bit)
+static inline int rle_put_bit(struct rle_writer *rle, int bit)
 {
 	if (rle->cnt < 0)
 		return rle->cnt;
@@ -88,7 +98,7 @@ int rle_put_bit(struct rle_writer *rle, int bit)
 	return vli_put_bit(rle->vli, bit);
 }
 
-int rle_get_bit(struct rle_reader *rle)
+static inline int rle_get_bit(struct rle_reader *rle)
 {
 	if (rle->cnt < 0)
 		return rle->cnt;
@@ -102,3 +112,82 @@ int rle_get_bit(struct rle_reader *rle)
 	return vli_get_bit(rle->vli);
 }
 
+/*
+rle_put_mask() codes the bits of "bits" at the positions set in "todo",
+starting from the lowest position, up to and including the first one.
+The coded positions are cleared from "todo" and the position of the one
+is returned, or 64 if all bits were zero. rle_get_mask() does the same
+for the decoder. Runs of zeros are counted and skipped as a whole: the
+decoder finds the end of a run with rle_select(), which gives the
+position of the n-th lowest set bit, counting from zero, with pdep where
+the target has it. Else the few lowest bits of short runs are cleared
+one by one and longer runs sum the bits of all bytes at once, which
+leaves at most seven bits to clear inside a single byte.
+*/
+
+static inline int rle_select(uint64_t bits, int n)
+{
+#ifdef __BMI2__
+	return __builtin_ctzll(_pdep_u64((uint64_t)1 << n, bits));
+#else
+	if (n < 8) {
+		while (n--)
+			bits &= bits - 1;
+		return __builtin_ctzll(bits);
+	}
+	uint64_t ones = 0x0101010101010101, highs = 0x8080808080808080;
+	uint64_t cnt = bits - ((bits >> 1) & 0x5555555555555555);
+	cnt = (cnt & 0x3333333333333333) + ((cnt >> 2) & 0x3333333333333333);
+	uint64_t sums = ((cnt + (cnt >> 4)) & 0x0f0f0f0f0f0f0f0f) * ones;
+	uint64_t below = ((n * ones | highs) - sums) & highs;
+	int shift = 8 * ((below >> 7) * ones >> 56);
+	n -= shift ? sums >> (shift - 8) & 0xff : 0;
+	uint64_t byte = bits >> shift & 0xff;
+	while (n--)
+		byte &= byte - 1;
+	return shift + __builtin_ctzll(byte);
+#endif
+}
+
+static inline int rle_put_mask(struct rle_writer *rle, uint64_t *todo, uint64_t bits)
+{
+	if (rle->cnt < 0)
+		return rle->cnt;
+	uint64_t ones = *todo & bits;
+	if (!ones) {
+		rle->cnt += __builtin_popcountll(*todo);
+		*todo = 0;
+		return 64;
+	}
+	int pos = __builtin_ctzll(ones);
+	rle->cnt += __builtin_popcountll(*todo & (((uint64_t)1 << pos) - 1));
+	*todo &= ~(uint64_t)1 << pos;
+	int ret = put_rle(rle, 1);
+	if (ret)
+		return ret;
+	return pos;
+}
+
+static inline int rle_get_mask(struct rle_reader *rle, uint64_t *todo)
+{
+	if (rle->cnt < 0)
+		return rle->cnt;
+	if (!*todo)
+		return 64;
+	if (!rle->cnt) {
+		int ret = get_vli(rle->vli);
+		if (ret < 0)
+			return rle->cnt = ret;
+		rle->cnt = ret + 1;
+	}
+	int num = __builtin_popcountll(*todo);
+	if (rle->cnt > num) {
+		rle->cnt -= num;
+		*todo = 0;
+		return 64;
+	}
+	int pos = rle_select(*todo, rle->cnt - 1);
+	rle->cnt = 0;
+	*todo &= ~(uint64_t)1 << pos;
+	return pos;
+}
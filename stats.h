@@ -0,0 +1,41 @@
+/*
+Statistics collected by the codec
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include "timer.h"
+
+/*
+A pass codes a plane of a level of a channel. Its bits are counted when
+they are written, so the bits of a run of zeros count for the pass that
+ends the run, and the range coder counts whole bytes. Runs are counted
+by their number of bits, the first bucket holds the runs of length zero.
+"cuts" counts the tiles, at the layer where their capacity ran out. Only
+a picture without tiles is coded to a capacity, tiles are cut later.
+Tiles on other threads add to the same counters.
+*/
+
+#define STATS_LEVELS 32
+#define STATS_PLANES 16
+#define STATS_RUNS 32
+#define STATS_LAYERS 64
+
+struct stats {
+	int mode, width, height, tile;
+	long long capacity;
+	long long bytes;
+	long long nanos[STAGES];
+	long long bits[3][STATS_LEVELS][STATS_PLANES];
+	long long signs[3][STATS_LEVELS][STATS_PLANES];
+	long long refinements[3][STATS_LEVELS][STATS_PLANES];
+	long long runs[STATS_RUNS];
+	long long cuts[STATS_LAYERS];
+};
+
+static inline void stats_add(long long *counter, long long value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
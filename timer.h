@@ -0,0 +1,37 @@
+/*
+Wall time spent in the stages of the codec
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#pragma once
+
+#include <time.h>
+
+enum { STAGE_READ, STAGE_COPY, STAGE_DOIT, STAGE_PROCESS, STAGE_DESCEND, STAGE_CODE, STAGES };
+
+static inline const char *stage_name(int stage)
+{
+	static const char *names[STAGES] = { "read", "copy", "doit", "process", "descend", "code" };
+	return names[stage];
+}
+
+static inline long long timer_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+timer_stage() adds the nanoseconds since "start" to the stage and returns
+the start of the next stage. Tiles on other threads add to the same
+stages, so the times of a tiled picture add up over all tiles.
+*/
+
+static inline long long timer_stage(long long *nanos, int stage, long long start)
+{
+	long long now = timer_now();
+	__atomic_fetch_add(nanos + stage, now - start, __ATOMIC_RELAXED);
+	return now;
+}
@@ -0,0 +1,65 @@
+/*
+Cut streams of the quadtree image codec to lower rates without decoding them
+
+Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "lqt.h"
+#include "bits.h"
+
+int main(int argc, char **argv)
+{
+	if (argc < 4 || argc > 5) {
+		fprintf(stderr, "usage: %s input.lqt output.lqt BUDGET [LAYERS]\n", argv[0]);
+		return 1;
+	}
+	char *unit;
+	long long budget = strtoll(argv[3], &unit, 10);
+	int percent = *unit == '%';
+	if (budget < 0 || (*unit && !percent) || (percent && budget > 100)) {
+		fprintf(stderr, "budget \"%s\" is neither a number of bits nor a percentage.\n", argv[3]);
+		return 1;
+	}
+	int layers = -1;
+	if (argc > 4 && (layers = atoi(argv[4])) < 0) {
+		fprintf(stderr, "number of layers \"%s\" is negative.\n", argv[4]);
+		return 1;
+	}
+	struct bits_reader *bits = bits_reader(argv[1]);
+	if (!bits)
+		return 1;
+	uint8_t *buffer = 0;
+	size_t input_size;
+	const uint8_t *input = input_bytes(bits, &buffer, &input_size);
+	if (percent)
+		budget = budget * input_size * 8 / 100;
+	struct lqt *lqt = lqt_new();
+	lqt_name(lqt, argv[1]);
+	const uint8_t *data;
+	size_t size;
+	int error = lqt_truncate(lqt, input, input_size, budget, layers, &data, &size);
+	free(buffer);
+	close_reader(bits);
+	if (error) {
+		lqt_delete(lqt);
+		return 1;
+	}
+	FILE *file = fopen(argv[2], "w");
+	if (!file) {
+		fprintf(stderr, "could not open \"%s\" file to write.\n", argv[2]);
+		lqt_delete(lqt);
+		return 1;
+	}
+	error = size != fwrite(data, 1, size, file);
+	if (error)
+		fprintf(stderr, "could not write to file \"%s\".\n", argv[2]);
+	fclose(file);
+	lqt_delete(lqt);
+	if (error)
+		return 1;
+	long long kib = (size + 512) / 1024;
+	fprintf(stderr, "%lld bits (%lld KiB) kept\n", 8 * (long long)size, kib);
+	return 0;
+}
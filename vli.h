@@ -6,6 +6,7 @@ Copyright 2021 Ahmet Inan <xdsopl@gmail.com>
 
 #pragma once
 
+#include <limits.h>
 #include "bits.h"
 
 struct vli_reader {
@@ -16,74 +17,83 @@ struct vli_writer {
 	struct bits_writer *bits;
 };
 
-struct vli_reader *vli_reader(struct bits_reader *bits)
+static inline struct vli_reader *vli_reader(struct bits_reader *bits)
 {
 	struct vli_reader *vli = malloc(sizeof(struct vli_reader));
 	vli->bits = bits;
 	return vli;
 }
 
-struct vli_writer *vli_writer(struct bits_writer *bits)
+static inline struct vli_writer *vli_writer(struct bits_writer *bits)
 {
 	struct vli_writer *vli = malloc(sizeof(struct vli_writer));
 	vli->bits = bits;
 	return vli;
 }
 
-void delete_vli_reader(struct vli_reader *vli)
+static inline void delete_vli_reader(struct vli_reader *vli)
 {
 	free(vli);
 }
 
-void delete_vli_writer(struct vli_writer *vli)
+static inline void delete_vli_writer(struct vli_writer *vli)
 {
 	free(vli);
 }
 
-int vli_put_bit(struct vli_writer *vli, int bit)
+static inline int vli_put_bit(struct vli_writer *vli, int bit)
 {
 	return put_bit(vli->bits, bit);
 }
 
-int vli_get_bit(struct vli_reader *vli)
+static inline int vli_get_bit(struct vli_reader *vli)
 {
 	return get_bit(vli->bits);
 }
 
-int vli_write_bits(struct vli_writer *vli, int b, int n)
+static inline int vli_write_bits(struct vli_writer *vli, int b, int n)
 {
 	return write_bits(vli->bits, b, n);
 }
 
-int vli_read_bits(struct vli_reader *vli, int *b, int n)
+static inline int vli_read_bits(struct vli_reader *vli, int *b, int n)
 {
 	return read_bits(vli->bits, b, n);
 }
 
-int put_vli(struct vli_writer *vli, int val)
+static inline int vli_bits(long long val)
 {
-	int cnt = 0, top = 1;
-	while (top <= val) {
-		cnt += 1;
-		top = 1 << cnt;
-		int ret = put_bit(vli->bits, 1);
-		if (ret)
-			return ret;
-	}
-	int ret = put_bit(vli->bits, 0);
+	int cnt = 0;
+	while (cnt < 63 && 1LL << cnt <= val)
+		++cnt;
+	return cnt ? 2 * cnt : 1;
+}
+
+/*
+A value with "cnt" significant bits is coded as "cnt" ones, a zero and
+the lower "cnt-1" bits, lowest bit first. put_vli() assembles the code
+with a count leading zeros, and get_vli() finds the length of a code
+with a count trailing zeros in the peeked bits, so both take only a few
+shifts and masks. The bit by bit versions are left for the end of the
+stream and for broken codes.
+*/
+
+static inline int put_vli(struct vli_writer *vli, int val)
+{
+	if (val <= 0)
+		return write_bits(vli->bits, 0, 1);
+	int cnt = 32 - __builtin_clz(val);
+	uint32_t ones = ((uint32_t)1 << cnt) - 1;
+	uint32_t rest = val - (1 << (cnt-1));
+	if (cnt <= 16)
+		return write_bits(vli->bits, ones | rest << (cnt+1), 2*cnt);
+	int ret = write_bits(vli->bits, ones, cnt+1);
 	if (ret)
 		return ret;
-	if (cnt > 0) {
-		cnt -= 1;
-		val -= top/2;
-		int ret = write_bits(vli->bits, val, cnt);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	return write_bits(vli->bits, rest, cnt-1);
 }
 
-int get_vli(struct vli_reader *vli)
+static inline int get_vli_slow(struct vli_reader *vli)
 {
 	int val = 0, cnt = 0, top = 1, ret;
 	while ((ret = get_bit(vli->bits)) == 1) {
@@ -101,3 +111,56 @@ int get_vli(struct vli_reader *vli)
 	return val;
 }
 
+static inline int get_vli(struct vli_reader *vli)
+{
+	uint64_t word;
+	int num = peek_bits(vli->bits, &word);
+	if (!~word)
+		return get_vli_slow(vli);
+	int cnt = __builtin_ctzll(~word);
+	int len = cnt ? 2*cnt : 1;
+	if (cnt > 31 || len > num)
+		return get_vli_slow(vli);
+	skip_bits(vli->bits, len);
+	if (!cnt)
+		return 0;
+	return (1 << (cnt-1)) + (int)((word >> (cnt+1)) & (((uint64_t)1 << (cnt-1)) - 1));
+}
+
+/*
+put_vli_long() and get_vli_long() code sizes and offsets of up to 63
+bits the same way, so values that fit into an int give the same code.
+*/
+
+static inline int put_vli_long(struct vli_writer *vli, long long val)
+{
+	if (val <= INT_MAX)
+		return put_vli(vli, val);
+	int cnt = 64 - __builtin_clzll(val);
+	int ret = write_bits(vli->bits, ~0, 32);
+	if (!ret)
+		ret = write_bits(vli->bits, ((uint32_t)1 << (cnt-32)) - 1, cnt-31);
+	for (int shift = 0; !ret && shift < cnt-1; shift += 32)
+		ret = write_bits(vli->bits, val >> shift, cnt-1-shift < 32 ? cnt-1-shift : 32);
+	return ret;
+}
+
+static inline long long get_vli_long(struct vli_reader *vli)
+{
+	long long val = 0;
+	int cnt = 0, ret;
+	while ((ret = get_bit(vli->bits)) == 1)
+		if (++cnt > 63)
+			return -1;
+	if (ret < 0)
+		return ret;
+	if (!cnt)
+		return 0;
+	for (int shift = 0; shift < cnt-1; shift += 32) {
+		int num = cnt-1-shift < 32 ? cnt-1-shift : 32, bits;
+		if ((ret = read_bits(vli->bits, &bits, num)))
+			return ret;
+		val |= (long long)(uint32_t)bits << shift;
+	}
+	return val + (1LL << (cnt-1));
+}